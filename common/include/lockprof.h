@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock is a `mutex_t`.
+#define LOCKPROF_MUTEX    0
+// Lock is a `spinlock_t`.
+#define LOCKPROF_SPINLOCK 1
+// Lock is a raw `atomic_flag` spinlock, as used by the kernel allocator.
+#define LOCKPROF_FLAG     2
+
+// Contention statistics for one lock acquired from one call site on one CPU.
+typedef struct {
+    // Address of the lock.
+    size_t   lock;
+    // Return address of the call that acquired the lock.
+    size_t   site;
+    // CPU the statistics were recorded on.
+    int      cpu;
+    // Kind of lock, one of `LOCKPROF_*`.
+    int      kind;
+    // Number of acquisitions.
+    uint32_t acquisitions;
+    // Number of acquisitions that found the lock already taken.
+    uint32_t contended;
+    // Total time spent waiting for the lock in microseconds.
+    int64_t  wait_time;
+    // Longest time the lock was held in microseconds.
+    int64_t  max_hold_time;
+} lockprof_entry_t;
@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdint.h>
+
+// A CPU switched to thread `tid`; `arg` is its effective priority.
+#define SCHEDTRACE_SWITCH  1
+// Thread `tid` was handed off to CPU `arg`.
+#define SCHEDTRACE_HANDOFF 2
+// Thread `tid` blocked waiting for a mutex; `arg` is 1 if it waited for a share.
+#define SCHEDTRACE_BLOCK   3
+// Thread `tid` was woken by a mutex being released; `arg` is 1 if it was granted a share.
+#define SCHEDTRACE_WAKE    4
+// Thread `tid` was stolen from CPU `arg` by load balancing.
+#define SCHEDTRACE_MIGRATE 5
+
+// Scheduler trace record.
+typedef struct {
+    // Time of the event in microseconds.
+    int64_t  time;
+    // Thread the event applies to.
+    int32_t  tid;
+    // Kind of event, one of `SCHEDTRACE_*`.
+    uint16_t event;
+    // Event-specific argument.
+    int16_t  arg;
+} schedtrace_rec_t;
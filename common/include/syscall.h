@@ -12,6 +12,8 @@
 #else
 
 #include "hal/gpio.h"
+#include "lockprof.h"
+#include "schedtrace.h"
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "mutex.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    // Incremented every time the condition variable is signalled.
+    atomic_int seq;
+} condvar_t;
+
+#define CONDVAR_T_INIT ((condvar_t){0})
+
+
+
+// Recommended way to create a condition variable at run-time.
+void condvar_init(condvar_t *cond);
+// Release `mutex` and wait at most `timeout` microseconds for `cond` to be signalled.
+// If `timeout` is negative, wait indefinitely.
+// `mutex` is re-acquired before returning.
+// Returns false if the timeout expired, true otherwise; spurious wakeups are possible.
+bool condvar_wait(condvar_t *cond, mutex_t *mutex, int64_t timeout);
+// Wake up one thread waiting on `cond`.
+void condvar_signal(condvar_t *cond);
+// Wake up all threads waiting on `cond`.
+void condvar_broadcast(condvar_t *cond);
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+typedef struct {
+    // 0 if unlocked, 1 if locked, 2 if locked and there may be waiting threads.
+    atomic_int state;
+} mutex_t;
+
+#define MUTEX_T_INIT ((mutex_t){0})
+
+
+
+// Recommended way to create a mutex at run-time.
+void mutex_init(mutex_t *mutex);
+// Acquire `mutex`, blocking until it is available.
+void mutex_lock(mutex_t *mutex);
+// Try to acquire `mutex` without blocking.
+// Returns true if the mutex was successfully acquired.
+bool mutex_trylock(mutex_t *mutex);
+// Release `mutex`, which must be held by the calling thread.
+void mutex_unlock(mutex_t *mutex);
@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: MIT
+
+#include "condvar.h"
+
+#include "errno.h"
+#include "syscall.h"
+
+#include <limits.h>
+
+
+
+// Recommended way to create a condition variable at run-time.
+void condvar_init(condvar_t *cond) {
+    *cond = CONDVAR_T_INIT;
+}
+
+// Release `mutex` and wait at most `timeout` microseconds for `cond` to be signalled.
+// If `timeout` is negative, wait indefinitely.
+// `mutex` is re-acquired before returning.
+// Returns false if the timeout expired, true otherwise; spurious wakeups are possible.
+bool condvar_wait(condvar_t *cond, mutex_t *mutex, int64_t timeout) {
+    // Sampled while `mutex` is held so a signal sent after releasing it is not missed.
+    int seq = atomic_load_explicit(&cond->seq, memory_order_relaxed);
+    mutex_unlock(mutex);
+    int res = syscall_futex_wait((int *)&cond->seq, seq, timeout);
+    mutex_lock(mutex);
+    return res != -ETIMEDOUT;
+}
+
+// Wake up one thread waiting on `cond`.
+void condvar_signal(condvar_t *cond) {
+    atomic_fetch_add_explicit(&cond->seq, 1, memory_order_release);
+    syscall_futex_wake((int *)&cond->seq, 1);
+}
+
+// Wake up all threads waiting on `cond`.
+void condvar_broadcast(condvar_t *cond) {
+    atomic_fetch_add_explicit(&cond->seq, 1, memory_order_release);
+    syscall_futex_wake((int *)&cond->seq, INT_MAX);
+}
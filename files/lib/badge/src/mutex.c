@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: MIT
+
+#include "mutex.h"
+
+#include "syscall.h"
+
+
+
+// Recommended way to create a mutex at run-time.
+void mutex_init(mutex_t *mutex) {
+    *mutex = MUTEX_T_INIT;
+}
+
+// Acquire `mutex`, blocking until it is available.
+void mutex_lock(mutex_t *mutex) {
+    // Uncontended case; no system call needed.
+    int state = 0;
+    if (atomic_compare_exchange_strong_explicit(&mutex->state, &state, 1, memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+    // Mark the mutex as contended and sleep until it is released.
+    if (state != 2) {
+        state = atomic_exchange_explicit(&mutex->state, 2, memory_order_acquire);
+    }
+    while (state != 0) {
+        syscall_futex_wait((int *)&mutex->state, 2, -1);
+        state = atomic_exchange_explicit(&mutex->state, 2, memory_order_acquire);
+    }
+}
+
+// Try to acquire `mutex` without blocking.
+// Returns true if the mutex was successfully acquired.
+bool mutex_trylock(mutex_t *mutex) {
+    int state = 0;
+    return atomic_compare_exchange_strong_explicit(
+        &mutex->state,
+        &state,
+        1,
+        memory_order_acquire,
+        memory_order_relaxed
+    );
+}
+
+// Release `mutex`, which must be held by the calling thread.
+void mutex_unlock(mutex_t *mutex) {
+    if (atomic_fetch_sub_explicit(&mutex->state, 1, memory_order_release) != 1) {
+        // There may be waiting threads; wake one of them.
+        atomic_store_explicit(&mutex->state, 0, memory_order_release);
+        syscall_futex_wake((int *)&mutex->state, 1);
+    }
+}
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: MIT
+
+#include "syscall.h"
+
+// Maximum number of records read per CPU.
+#define MAX_RECORDS 1024
+
+
+
+static schedtrace_rec_t records[MAX_RECORDS];
+
+size_t strlen(char const *cstr) {
+    char const *pre = cstr;
+    while (*cstr) cstr++;
+    return cstr - pre;
+}
+
+void print(char const *cstr) {
+    syscall_temp_write(cstr, strlen(cstr));
+}
+
+char const hextab[] = "0123456789ABCDEF";
+
+// Print a space followed by `value` in hexadecimal.
+void print_hex(uint64_t value) {
+    char  buf[18];
+    char *ptr = buf + sizeof(buf);
+    *--ptr    = 0;
+    do {
+        *--ptr   = hextab[value & 15];
+        value  >>= 4;
+    } while (value);
+    *--ptr = ' ';
+    print(ptr);
+}
+
+// Dumps the scheduler trace buffers of all CPUs to the log.
+// Every record is printed as `SCHEDTRACE <cpu> <time> <tid> <event> <arg>` with all numbers in hexadecimal,
+// which `tools/schedtrace-json.py` converts into a trace viewable in Perfetto.
+int main() {
+    for (int cpu = 0;; cpu++) {
+        int count = syscall_sys_schedtrace(cpu, records, MAX_RECORDS);
+        if (count < 0) {
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            print("SCHEDTRACE");
+            print_hex(cpu);
+            print_hex(records[i].time);
+            print_hex((uint32_t)records[i].tid);
+            print_hex(records[i].event);
+            print_hex((uint16_t)records[i].arg);
+            print("\n");
+        }
+    }
+    return 0;
+}
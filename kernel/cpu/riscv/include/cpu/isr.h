@@ -49,5 +49,9 @@ static inline void isr_pause() {
     // This is a fence with PRED=W and SUCC=none.
     asm(".word 0x0100000f");
 }
+// Halt the CPU until an interrupt is pending, even if interrupts are disabled.
+static inline void isr_wait() {
+    asm volatile("wfi");
+}
 
 #endif
@@ -10,6 +10,10 @@
 // Called by the interrupt handler when the CPU-local timer fires.
 void riscv_sbi_timer_interrupt();
 #endif
+#ifdef CPU_RISCV_ENABLE_SBI_IPI
+// Called by the interrupt handler when another CPU requested a reschedule.
+void riscv_sbi_ipi_interrupt();
+#endif
 
 // Interrupt handler for the INTC to forward external interrupts to.
 void (*intc_ext_irq_handler)();
@@ -26,6 +30,10 @@ void riscv_interrupt_handler() {
     } else if (int_no == RISCV_INT_SUPERVISOR_TIMER) {
         asm("csrc sie, %0" ::"r"(1 << RISCV_INT_SUPERVISOR_TIMER));
         riscv_sbi_timer_interrupt();
+#endif
+#ifdef CPU_RISCV_ENABLE_SBI_IPI
+    } else if (int_no == RISCV_INT_SUPERVISOR_SOFT) {
+        riscv_sbi_ipi_interrupt();
 #endif
     } else {
         logkf_from_isr(LOG_FATAL, "Unhandled interrupt 0x%{long;x}", cause);
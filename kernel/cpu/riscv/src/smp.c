@@ -11,6 +11,7 @@
 #include "isr_ctx.h"
 #include "mutex.h"
 #include "port/dtb.h"
+#include "scheduler/isr.h"
 
 #include <limine.h>
 
@@ -82,6 +83,8 @@ static smp_map_t *smp_unmap;
 static smp_status_t *cpu_status;
 // Whether the SBI supports HSM.
 static bool          sbi_supports_hsm;
+// Whether the SBI supports IPI.
+static bool          sbi_supports_ipi;
 
 
 static REQ struct limine_smp_request smp_req = {
@@ -102,6 +105,16 @@ void smp_init_dtb(dtb_handle_t *dtb) {
         // SBI doesn't support HSM; CPUs can be started but not stopped.
         logk(LOG_DEBUG, "SBI doesn't support HSM");
     }
+    res              = sbi_probe_extension(SBI_IPI_EID);
+    sbi_supports_ipi = res.retval && !res.status;
+    if (sbi_supports_ipi) {
+        // SBI supports IPI; enable software interrupts so other CPUs can request a reschedule.
+        logk(LOG_DEBUG, "SBI supports IPI");
+        asm("csrs sie, %0" ::"r"(1 << RISCV_INT_SUPERVISOR_SOFT));
+    } else {
+        // SBI doesn't support IPI; CPUs only reschedule on their own timer.
+        logk(LOG_DEBUG, "SBI doesn't support IPI");
+    }
 
     // Parse CPU ID information from the DTB.
     dtb_node_t *cpus = dtb_get_node(dtb, dtb_root_node(dtb), "cpus");
@@ -199,7 +212,7 @@ size_t smp_get_cpuid(int cpu) {
     smp_map_t         dummy = {.cpu = cpu};
     array_binsearch_t res   = array_binsearch(smp_unmap, sizeof(smp_map_t), smp_unmap_len, &dummy, smp_cpu_cmp);
     if (res.found) {
-        return smp_map[res.index].cpuid;
+        return smp_unmap[res.index].cpuid;
     }
     return -1;
 }
@@ -228,6 +241,9 @@ static void cpu1_init1_limine(struct limine_smp_info *info) {
     tmp_ctx.cpulocal->cpuid = info->hartid;
     tmp_ctx.cpulocal->cpu   = cur_cpu;
     asm("csrw sscratch, %0" ::"r"(&tmp_ctx));
+    if (sbi_supports_ipi) {
+        asm("csrs sie, %0" ::"r"(1 << RISCV_INT_SUPERVISOR_SOFT));
+    }
     cpu_status[cur_cpu].entrypoint();
     __builtin_trap();
 }
@@ -272,3 +288,23 @@ bool smp_pause() {
 bool smp_resume(int cpu) {
     return false;
 }
+
+// Request another CPU to run its scheduler, if supported.
+bool smp_resched(int cpu) {
+    if (!sbi_supports_ipi || cpu < 0 || cpu >= smp_count) {
+        return false;
+    }
+    size_t cpuid = smp_get_cpuid(cpu);
+    return sbi_send_ipi(1, cpuid).status == 0;
+}
+
+// Whether `smp_resched` is supported.
+bool smp_has_resched() {
+    return sbi_supports_ipi;
+}
+
+// Called by the interrupt handler when another CPU requested a reschedule.
+void riscv_sbi_ipi_interrupt() {
+    asm("csrc sip, %0" ::"r"(1 << RISCV_INT_SUPERVISOR_SOFT));
+    sched_request_switch_from_isr();
+}
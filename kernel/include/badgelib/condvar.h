@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "mutex.h"
+#include "time.h"
+#include "waitqueue.h"
+
+#include <stdbool.h>
+
+typedef struct {
+    // Threads waiting for the condition variable.
+    waitqueue_t waiters;
+} condvar_t;
+
+#define CONDVAR_T_INIT ((condvar_t){{ATOMIC_FLAG_INIT, 0, {0}}})
+
+
+
+// Recommended way to create a condition variable at run-time.
+void condvar_init(condvar_t *cond);
+// Clean up the condition variable.
+// There must be no threads waiting on it.
+void condvar_destroy(condvar_t *cond);
+
+// Release `mutex` and wait at most `max_wait_us` microseconds for `cond` to be signalled.
+// `mutex` must be held exclusively by the caller and is re-acquired before returning.
+// If `max_wait_us` is too long or negative, do not use the timeout.
+// Returns false if the timeout expired, true otherwise; spurious wakeups are possible.
+bool condvar_wait(condvar_t *cond, mutex_t *mutex, timestamp_us_t max_wait_us);
+// Wake up one thread waiting on `cond`.
+void condvar_signal(condvar_t *cond);
+// Wake up all threads waiting on `cond`.
+void condvar_broadcast(condvar_t *cond);
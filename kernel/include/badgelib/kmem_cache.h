@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Slab of an object cache.
+typedef struct kmem_slab kmem_slab_t;
+
+// Object constructor; puts a newly allocated object in its cached state.
+// Returns false if the object could not be constructed.
+typedef bool (*kmem_ctor_t)(void *obj);
+// Object destructor; releases what the constructor acquired.
+typedef void (*kmem_dtor_t)(void *obj);
+
+// Object cache statistics.
+typedef struct {
+    // Number of slabs.
+    size_t slabs;
+    // Number of pages in those slabs.
+    size_t pages;
+    // Number of objects in those slabs.
+    size_t objs;
+    // Number of objects currently allocated.
+    size_t active;
+    // Total number of allocations.
+    size_t allocs;
+    // Total number of frees.
+    size_t frees;
+} kmem_cache_stats_t;
+
+// Cache of fixed-size kernel objects.
+// Objects are kept in their constructed state while cached, so only the first allocation of an object pays for it.
+typedef struct kmem_cache {
+    // Name of the object type, for statistics.
+    char const         *name;
+    // Size of the objects.
+    size_t              size;
+    // Alignment of the objects.
+    size_t              align;
+    // Optional object constructor.
+    kmem_ctor_t         ctor;
+    // Optional object destructor.
+    kmem_dtor_t         dtor;
+    // Spinlock guarding the slab lists and statistics.
+    atomic_flag         lock;
+    // Whether the slab layout was computed and the cache was added to the list of caches.
+    bool                ready;
+    // Distance between objects in a slab.
+    size_t              stride;
+    // Offset of the first object in a slab.
+    size_t              first;
+    // Number of pages per slab.
+    uint16_t            slab_pages;
+    // Number of objects per slab.
+    uint16_t            slab_objs;
+    // Slabs with free objects; the empty slab, if any, is last.
+    kmem_slab_t        *partial;
+    // Slabs without free objects.
+    kmem_slab_t        *full;
+    // Number of slabs without allocated objects; at most one is kept.
+    size_t              empty;
+    // Statistics.
+    kmem_cache_stats_t  stats;
+    // Next cache in the list of caches.
+    struct kmem_cache  *next;
+} kmem_cache_t;
+
+// Initializer for an object cache of `type`.
+#define KMEM_CACHE_T_INIT(name_, type_, ctor_, dtor_)                                                                  \
+    ((kmem_cache_t){                                                                                                   \
+        .name  = (name_),                                                                                              \
+        .size  = sizeof(type_),                                                                                        \
+        .align = _Alignof(type_),                                                                                      \
+        .ctor  = (ctor_),                                                                                              \
+        .dtor  = (dtor_),                                                                                              \
+        .lock  = ATOMIC_FLAG_INIT,                                                                                     \
+    })
+
+
+
+// Allocate a constructed object from `cache`.
+// Returns NULL if out of memory or if the constructor failed.
+void *kmem_cache_alloc(kmem_cache_t *cache);
+// Return an object to `cache`.
+// The object must be back in its constructed state.
+void  kmem_cache_free(kmem_cache_t *cache, void *obj);
+// Get a snapshot of the statistics of `cache`.
+void  kmem_cache_get_stats(kmem_cache_t *cache, kmem_cache_stats_t *stats);
+// Log the statistics of all object caches that have been used.
+void  kmem_cache_log_stats();
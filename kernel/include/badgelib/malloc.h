@@ -10,3 +10,8 @@ void *realloc(void *ptr, size_t size);
 void *reallocarray(void *ptr, size_t nmemb, size_t size);
 
 void kernel_heap_init();
+
+// Allocate whole pages for the object caches.
+void *kernel_heap_alloc_cache_pages(size_t size);
+// Free pages allocated by `kernel_heap_alloc_cache_pages`.
+void  kernel_heap_free_cache_pages(void *ptr);
@@ -8,24 +8,52 @@
 
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct {
     // Mutex allows sharing.
-    bool        is_shared;
+    bool                   is_shared;
     // Allow accessing from ISR.
-    bool        allow_isr;
+    bool                   allow_isr;
     // Spinlock guarding the waiting list.
-    atomic_flag wait_spinlock;
+    atomic_flag            wait_spinlock;
     // Share count and/or is locked.
-    atomic_int  shares;
+    atomic_int             shares;
+    // Number of threads waiting for exclusive access; new shares are not handed out while nonzero.
+    atomic_int             excl_waiting;
     // List of threads waiting for this mutex.
-    dlist_t     waiting_list;
+    dlist_t                waiting_list;
+    // Thread holding this mutex exclusively, if it was acquired outside of an ISR.
+    // Used to boost its priority while higher-priority threads wait.
+    struct sched_thread_t *owner;
+    // Number of times a thread spun waiting for a running owner to release this mutex.
+    atomic_uint            spins;
+    // Number of times a thread blocked waiting for this mutex.
+    atomic_uint            blocks;
+    // Number of exclusive acquisitions outside of an ISR.
+    uint32_t               acquires;
+    // Total time this mutex was held by those acquisitions.
+    timestamp_us_t         hold_time;
+    // Time at which the current owner acquired this mutex, or 0 if not held by a thread.
+    timestamp_us_t         acquired_at;
 } mutex_t;
 
-#define MUTEX_T_INIT            ((mutex_t){0, 0, ATOMIC_FLAG_INIT, 0, {0}})
-#define MUTEX_T_INIT_SHARED     ((mutex_t){1, 0, ATOMIC_FLAG_INIT, 0, {0}})
-#define MUTEX_T_INIT_ISR        ((mutex_t){0, 1, ATOMIC_FLAG_INIT, 0, {0}})
-#define MUTEX_T_INIT_SHARED_ISR ((mutex_t){1, 1, ATOMIC_FLAG_INIT, 0, {0}})
+// Contention statistics of a mutex.
+typedef struct {
+    // Number of times a thread spun waiting for a running owner to release the mutex.
+    uint32_t       spins;
+    // Number of times a thread blocked waiting for the mutex.
+    uint32_t       blocks;
+    // Number of exclusive acquisitions outside of an ISR.
+    uint32_t       acquires;
+    // Average time the mutex was held by those acquisitions.
+    timestamp_us_t avg_hold_time;
+} mutex_stats_t;
+
+#define MUTEX_T_INIT            ((mutex_t){0, 0, ATOMIC_FLAG_INIT, 0, 0, {0}, 0, 0, 0, 0, 0, 0})
+#define MUTEX_T_INIT_SHARED     ((mutex_t){1, 0, ATOMIC_FLAG_INIT, 0, 0, {0}, 0, 0, 0, 0, 0, 0})
+#define MUTEX_T_INIT_ISR        ((mutex_t){0, 1, ATOMIC_FLAG_INIT, 0, 0, {0}, 0, 0, 0, 0, 0, 0})
+#define MUTEX_T_INIT_SHARED_ISR ((mutex_t){1, 1, ATOMIC_FLAG_INIT, 0, 0, {0}, 0, 0, 0, 0, 0, 0})
 
 #include "badge_err.h"
 
@@ -53,6 +81,7 @@ bool mutex_release_from_isr(badge_err_t *ec, mutex_t *mutex);
 
 // Try to acquire a share in `mutex` within `max_wait_us` microseconds.
 // If `max_wait_us` is too long or negative, do not use the timeout.
+// New shares wait for threads waiting for exclusive access, so shares must not be acquired recursively.
 // Returns true if the share was successfully acquired.
 bool mutex_acquire_shared(badge_err_t *ec, mutex_t *mutex, timestamp_us_t max_wait_us);
 // Release `mutex`, if it was initially acquired by this thread.
@@ -65,3 +94,7 @@ bool mutex_acquire_shared_from_isr(badge_err_t *ec, mutex_t *mutex, timestamp_us
 // Release `mutex`, if it was initially acquired by this thread.
 // Returns true if the mutex was successfully released.
 bool mutex_release_shared_from_isr(badge_err_t *ec, mutex_t *mutex);
+
+// Get the contention statistics of `mutex`.
+// The statistics are updated without synchronization and are only approximate.
+mutex_stats_t mutex_get_stats(mutex_t const *mutex);
@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "time.h"
+#include "waitqueue.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+typedef struct {
+    // Number of available units.
+    atomic_int  value;
+    // Threads waiting for a unit to become available.
+    waitqueue_t waiters;
+} semaphore_t;
+
+#define SEMAPHORE_T_INIT(value) ((semaphore_t){(value), {ATOMIC_FLAG_INIT, 0, {0}}})
+
+
+
+// Recommended way to create a semaphore at run-time.
+void semaphore_init(semaphore_t *sem, int value);
+// Clean up the semaphore.
+// There must be no threads waiting on it.
+void semaphore_destroy(semaphore_t *sem);
+
+// Try to take a unit from `sem` within `max_wait_us` microseconds.
+// If `max_wait_us` is too long or negative, do not use the timeout.
+// Returns true if a unit was successfully taken.
+bool semaphore_wait(semaphore_t *sem, timestamp_us_t max_wait_us);
+// Try to take a unit from `sem` without blocking.
+// Returns true if a unit was successfully taken.
+bool semaphore_trywait(semaphore_t *sem);
+// Add a unit to `sem` and wake up a waiting thread, if any.
+// May be called from an ISR.
+void semaphore_post(semaphore_t *sem);
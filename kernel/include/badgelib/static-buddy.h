@@ -12,12 +12,14 @@
 #include <stdint.h>
 
 #define PAGE_SIZE 4096
-#ifdef CONFIG_TARGET_generic
+#if defined(CONFIG_TARGET_generic) || !defined(BADGEROS_KERNEL)
 #define MAX_MEMORY_POOLS 16
+#define PFN_ROOT_SLOTS   2048
 #else
 #define MAX_MEMORY_POOLS 4
+#define PFN_ROOT_SLOTS   64
 #endif
-#define MAX_SLAB_SIZE 256
+#define MAX_SLAB_SIZE 2048
 
 #define ALIGN_UP(x, y)   (void *)(((size_t)(x) + (y - 1)) & ~(y - 1))
 #define ALIGN_DOWN(x, y) (void *)((size_t)(x) & ~(y - 1))
@@ -25,7 +27,14 @@
 #define ALIGN_PAGE_UP(x)   ALIGN_UP(x, PAGE_SIZE)
 #define ALIGN_PAGE_DOWN(x) ALIGN_DOWN(x, PAGE_SIZE)
 
-enum block_type { BLOCK_TYPE_FREE, BLOCK_TYPE_USER, BLOCK_TYPE_PAGE, BLOCK_TYPE_SLAB, BLOCK_TYPE_ERROR };
+enum block_type {
+    BLOCK_TYPE_FREE,
+    BLOCK_TYPE_USER,
+    BLOCK_TYPE_PAGE,
+    BLOCK_TYPE_SLAB,
+    BLOCK_TYPE_CACHE,
+    BLOCK_TYPE_ERROR
+};
 enum slab_type { SLAB_TYPE_SLAB };
 
 void init_pool(void *mem_start, void *mem_end, uint32_t flags);
@@ -37,10 +46,12 @@ void   slab_deallocate(void *ptr);
 size_t slab_get_size(void *ptr);
 
 void           *buddy_allocate(size_t size, enum block_type type, uint32_t flags);
+void           *buddy_allocate_aligned(size_t size, size_t align, enum block_type type, uint32_t flags);
 void           *buddy_reallocate(void *ptr, size_t size);
 void            buddy_deallocate(void *ptr);
 enum block_type buddy_get_type(void *ptr);
 size_t          buddy_get_size(void *ptr);
+void           *buddy_get_start(void *ptr);
 
 typedef struct buddy_block {
     uint8_t             pid;
@@ -62,6 +73,7 @@ typedef struct {
     size_t         free_pages;
     uint8_t        max_order;
     uint8_t        max_order_free;
+    uint8_t        align_order;
     uint32_t       max_order_waste;
     buddy_block_t  waste_list;
     buddy_block_t *free_lists;
@@ -3,8 +3,10 @@
 
 #pragma once
 
+#include "list.h"
 #include "port/time.h"
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -16,13 +18,36 @@ typedef int64_t timestamp_us_t;
 
 typedef void (*timer_fn_t)(void *cookie);
 
+// Timing wheel.
+typedef struct time_wheel_t time_wheel_t;
+
+// Timer callback; embedded in the object it belongs to so arming it never allocates.
+typedef struct {
+    // Timing wheel slot link.
+    dlist_node_t   node;
+    // Timestamp to run callback at.
+    timestamp_us_t timestamp;
+    // Timer callback function.
+    timer_fn_t     callback;
+    // Cookie for timer callback function.
+    void          *cookie;
+    // Timing wheel slot this timer is in.
+    dlist_t       *slot;
+    // Timing wheel this timer is on, NULL if not armed.
+    time_wheel_t  *_Atomic wheel;
+    // Index + 1 of the CPU running the callback, or 0 if it isn't running.
+    atomic_int     running;
+} timer_node_t;
+
 // Sets the alarm time when the next callback switch should occur.
 void           time_set_next_task_switch(timestamp_us_t timestamp);
-// Attach a callback to a timer interrupt.
-// The callback with the lowest timestamp is likeliest, but not guaranteed, to run first.
-// Returns timer ID on success, -1 on failure.
-int64_t        time_add_async_task(timestamp_us_t timestamp, timer_fn_t callback, void *cookie);
-// Cancel a callback created with `time_add_async_task`.
-bool           time_cancel_async_task(int64_t taskno);
+// Arm a timer on this CPU to run `callback` at `timestamp`.
+// If the previous callback is still running on another CPU, waits for it to finish first.
+// Returns false if the timer was already armed.
+bool           time_add_timer(timer_node_t *timer, timestamp_us_t timestamp, timer_fn_t callback, void *cookie);
+// Disarm a timer, which may be armed on any CPU.
+// If the callback is running on another CPU, waits for it to finish; the callback can't be running after this.
+// Returns true if the timer was removed before its callback started running.
+bool           time_cancel_timer(timer_node_t *timer);
 // Get current time in microseconds.
 timestamp_us_t time_us();
@@ -3,19 +3,29 @@
 
 #pragma once
 
+#include "spinlock.h"
 #include "time.h"
 
-// Timer callback.
-typedef struct {
-    // Timer task no.
-    int64_t        taskno;
-    // Timestamp to run callback at.
-    timestamp_us_t timestamp;
-    // Timer callback function.
-    timer_fn_t     callback;
-    // Cookie for timer callback function.
-    void          *cookie;
-} timertask_t;
+// Number of bits in a timing wheel slot index.
+#define TIME_WHEEL_BITS       6
+// Number of slots per timing wheel level.
+#define TIME_WHEEL_SLOTS      (1 << TIME_WHEEL_BITS)
+// Number of levels in a timing wheel; each level's slots are `TIME_WHEEL_SLOTS` times longer than the last.
+#define TIME_WHEEL_LEVELS     4
+// Log2 of the timing wheel tick length in microseconds.
+#define TIME_WHEEL_TICK_SHIFT 10
+
+// Hierarchical timing wheel.
+struct time_wheel_t {
+    // Spinlock guarding the timing wheel.
+    spinlock_t lock;
+    // Tick the first level's current slot corresponds to.
+    int64_t    tick;
+    // Bitmap of non-empty slots per level.
+    uint64_t   bitmap[TIME_WHEEL_LEVELS];
+    // Timer slots per level.
+    dlist_t    slots[TIME_WHEEL_LEVELS][TIME_WHEEL_SLOTS];
+};
 
 // Time CPU-local data.
 typedef struct {
@@ -23,6 +33,8 @@ typedef struct {
     bool           timer_is_preempt;
     // Next time to preempt at.
     timestamp_us_t preempt_time;
+    // Timers armed on this CPU.
+    time_wheel_t   wheel;
 } time_cpulocal_t;
 
 
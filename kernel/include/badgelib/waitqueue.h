@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "list.h"
+#include "time.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+typedef struct {
+    // Spinlock guarding the waiting list.
+    atomic_flag wait_spinlock;
+    // Notification counter; detects notifications that race with blocking.
+    atomic_int  seq;
+    // List of threads waiting on this queue.
+    dlist_t     waiting_list;
+} waitqueue_t;
+
+#define WAITQUEUE_T_INIT ((waitqueue_t){ATOMIC_FLAG_INIT, 0, {0}})
+
+typedef struct process_t process_t;
+
+
+
+// Recommended way to create a wait queue at run-time.
+void waitqueue_init(waitqueue_t *queue);
+// Clean up the wait queue.
+// There must be no threads waiting on it.
+void waitqueue_destroy(waitqueue_t *queue);
+
+// Get the notification counter of `queue`, to be passed to `waitqueue_block`.
+// Must be read before checking the condition that is being waited for.
+int  waitqueue_seq(waitqueue_t *queue);
+// Block on `queue` for at most `max_wait_us` microseconds.
+// Returns immediately if `queue` was notified after `seq` was read.
+// If `max_wait_us` is too long or negative, do not use the timeout.
+// Returns false if the timeout expired, true otherwise.
+bool waitqueue_block(waitqueue_t *queue, int seq, timestamp_us_t max_wait_us);
+// Wake up the first thread waiting on `queue`.
+// Returns whether a thread was woken up.
+bool waitqueue_notify(waitqueue_t *queue);
+// Wake up all threads waiting on `queue`.
+// Returns the number of threads woken up.
+int  waitqueue_notify_all(waitqueue_t *queue);
+// Wake up the threads waiting on `queue` that belong to `process`.
+// Threads of other processes about to block on `queue` may return early, like after any other notification.
+// Returns the number of threads woken up.
+int  waitqueue_notify_process(waitqueue_t *queue, process_t *process);
@@ -11,11 +11,11 @@ typedef void (*hk_task_t)(int taskno, void *arg);
 void hk_init();
 
 // Add a one-time task with optional timestamp to the queue.
-// This task will be run in the "housekeeping" task.
+// This task will be run in the "housekeeping" worker of the calling CPU.
 // Returns the task number.
 int  hk_add_once(timestamp_us_t time, hk_task_t task, void *arg);
 // Add a repeating task with optional start timestamp to the queue.
-// This task will be run in the "housekeeping" task.
+// This task will be run in the "housekeeping" worker of the calling CPU.
 // Returns the task number.
 int  hk_add_repeated(timestamp_us_t time, timestamp_us_t interval, hk_task_t task, void *arg);
 // Cancel a housekeeping task.
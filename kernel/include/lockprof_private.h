@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "config.h"
+#include "lockprof.h"
+#include "time.h"
+
+#include <stdbool.h>
+
+#if CONFIG_LOCK_PROFILE
+// Record an acquisition of `lock` from `site` that waited `wait` microseconds.
+void lockprof_acquired(void const *lock, void const *site, int kind, bool contended, timestamp_us_t wait);
+// Record a release of `lock` by the current thread on this CPU.
+void lockprof_released(void const *lock);
+#endif
@@ -4,9 +4,12 @@
 #pragma once
 
 #include "filesystem.h"
+#include "kmem_cache.h"
 #include "process/process.h"
 
-extern mutex_t proc_mtx;
+extern mutex_t      proc_mtx;
+// Cache of pending signals.
+extern kmem_cache_t sigpending_cache;
 
 
 
@@ -56,6 +59,9 @@ file_t proc_find_fd_raw(badge_err_t *ec, process_t *process, int virt);
 // Remove a file from the process file handle list.
 void   proc_remove_fd_raw(badge_err_t *ec, process_t *process, int virt);
 
+// Wake the futex waiters belonging to an exiting process so they can return.
+void proc_futex_wake_all(process_t *process);
+
 // Perform a pre-resume check for a user thread.
 // Used to implement asynchronous events.
 void proc_pre_resume_cb(sched_thread_t *thread);
@@ -11,6 +11,7 @@
 #include "port/memprotect.h"
 #include "scheduler/scheduler.h"
 #include "signal.h"
+#include "waitqueue.h"
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -102,6 +103,8 @@ typedef struct process_t {
     dlist_t       sigpending;
     // Child process list.
     dlist_t       children;
+    // Threads blocked in `waitpid` until a child changes state.
+    waitqueue_t   waitpid_queue;
     // Signal handler virtual addresses.
     // First index is for signal handler returns.
     size_t        sighandlers[SIG_COUNT];
@@ -4,6 +4,7 @@
 #pragma once
 
 #include "scheduler/scheduler.h"
+#include "scheduler/types.h"
 
 
 
@@ -15,6 +16,23 @@ sched_thread_t *thread_dequeue_self();
 // The thread must not yet be in any runqueue.
 // Interrupts must be disabled.
 bool thread_handoff(sched_thread_t *thread, int cpu, bool force, int max_load);
+// Hand a list of woken threads off to a CPU at once.
+// Equivalent to a forced `thread_handoff` of each thread, but only takes the CPU's locks once.
+// Interrupts must be disabled.
+void thread_handoff_list(dlist_t *threads, int cpu);
+
+// Move a queued thread to the runqueue level of its current effective priority.
+// Interrupts must be disabled.
+void thread_requeue(sched_thread_t *thread);
+// Whether a thread is currently running on a CPU other than this one.
+// The result may be stale by the time it is used; it is only a hint for whether spinning is worthwhile.
+bool thread_running_elsewhere(sched_thread_t *thread);
+
+// Get the priority a thread is scheduled at, including priority inherited through mutexes.
+static inline int thread_effective_prio(sched_thread_t *thread) {
+    int inherited = atomic_load_explicit(&thread->inherited_prio, memory_order_relaxed);
+    return inherited > thread->priority ? inherited : thread->priority;
+}
 
 // Requests the scheduler to prepare a switch from inside an interrupt routine.
 void sched_request_switch_from_isr();
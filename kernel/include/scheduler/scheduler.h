@@ -34,6 +34,23 @@ typedef struct {
     atomic_int     cpu_usage;
 } timeusage_t;
 
+// Wake-to-run latency statistics.
+typedef struct {
+    // Number of wakeups measured.
+    uint64_t       count;
+    // Sum of all wake-to-run latencies.
+    timestamp_us_t total;
+    // Largest wake-to-run latency.
+    timestamp_us_t max;
+} sched_wakestat_t;
+
+// Set of CPUs a thread is allowed to run on; bit `n` allows CPU `n`.
+typedef uint64_t sched_cpumask_t;
+// Allow a thread to run on any CPU.
+#define SCHED_CPUMASK_ALL            ((sched_cpumask_t)-1)
+// Whether CPU `cpu` is in `mask`.
+#define SCHED_CPUMASK_HAS(mask, cpu) ((cpu) >= 0 && (cpu) < 64 && (((mask) >> (cpu)) & 1))
+
 // will be scheduled with smaller time slices than normal
 #define SCHED_PRIO_LOW    0
 // default value
@@ -53,6 +70,8 @@ bool sched_start_on(int cpu);
 void sched_exec() NORETURN;
 // Exit the scheduler and subsequenty shut down the CPU.
 void sched_exit(int cpu);
+// Get the wake-to-run latency statistics of a CPU.
+void sched_get_wakestat(int cpu, sched_wakestat_t *out);
 
 
 // Returns the current thread ID.
@@ -94,6 +113,15 @@ void thread_resume_from_isr(badge_err_t *ec, tid_t thread);
 void thread_resume_now_from_isr(badge_err_t *ec, tid_t thread);
 // Returns whether a thread is running; it is neither suspended nor has it exited.
 bool thread_is_running(badge_err_t *ec, tid_t thread);
+// Set the CPUs a thread is allowed to run on; the mask must include at least one existing CPU.
+// A thread that is on a CPU it is no longer allowed on is moved the next time that CPU schedules it.
+void thread_set_affinity(badge_err_t *ec, tid_t thread, sched_cpumask_t mask);
+// Get the CPUs a thread is allowed to run on.
+sched_cpumask_t thread_get_affinity(badge_err_t *ec, tid_t thread);
+// Move the calling thread into the earliest-deadline-first class with a budget of `runtime` every `period`.
+// If `runtime` is 0, moves the calling thread back into the normal class instead.
+// EDF threads run before all other threads and are throttled once their budget for the current period is used up.
+void            thread_set_edf(badge_err_t *ec, timestamp_us_t runtime, timestamp_us_t period);
 
 // Exits the current thread.
 // If the thread is detached, resources will be cleaned up.
@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "config.h"
+#include "schedtrace.h"
+
+#if CONFIG_SCHED_TRACE
+// Append an event to this CPU's scheduler trace buffer.
+// Never takes any locks, so it can be called from anywhere in the scheduler.
+void sched_trace(int event, int tid, int arg);
+#define SCHED_TRACE(event, tid, arg) sched_trace((event), (tid), (arg))
+#else
+#define SCHED_TRACE(event, tid, arg) ((void)0)
+#endif
@@ -9,6 +9,7 @@
 #include "list.h"
 #include "process/process.h"
 #include "scheduler.h"
+#include "waitqueue.h"
 
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -18,11 +19,31 @@
 
 
 // The minimum time a thread will run. `SCHED_PRIO_LOW` maps to this.
-#define SCHED_MIN_US        5000
+#define SCHED_MIN_US          5000
 // The time quota increment per increased priority.
-#define SCHED_INC_US        500
+#define SCHED_INC_US          500
 // The microsecond interval on which schedulers measure CPU load.
-#define SCHED_LOAD_INTERVAL 250000
+#define SCHED_LOAD_INTERVAL   250000
+// Number of priority levels in the runqueue; priorities above this are clamped.
+#define SCHED_PRIO_LEVELS     32
+// Maximum utilization EDF threads may reserve on a CPU in 0.01% increments.
+#define SCHED_EDF_MAX_UTIL    9000
+// The minimum runtime budget per period of an EDF thread.
+#define SCHED_EDF_MIN_US      100
+// The maximum period of an EDF thread; keeps the utilization computation from overflowing.
+#define SCHED_EDF_MAX_US      3600000000LL
+// Maximum number of unused thread handles and kernel stacks kept per CPU.
+#define SCHED_THREAD_POOL_MAX 8
+// Weight of older measurements in the load averages; each interval moves them 1/N towards the new measurement.
+#define SCHED_LOAD_EWMA       4
+// Threads that ran less than this many microseconds ago are assumed to still have a warm cache on their CPU.
+#define SCHED_CACHE_HOT_US    3000
+// Minimum number of microseconds between two migrations of a thread by work stealing.
+#define SCHED_MIGRATE_HOLD_US 20000
+// Minimum number of queued threads on another CPU before threads with a warm cache are stolen from it.
+#define SCHED_STEAL_HOT_LEN   3
+// Load difference in 0.01% increments below which woken threads stay on the CPU they last ran on.
+#define SCHED_BALANCE_HYST    1000
 
 
 
@@ -55,44 +76,105 @@
 #define SCHED_RUNNING  (1 << 1)
 // The scheduler is pending exit on this CPU.
 #define SCHED_EXITING  (1 << 2)
+// The scheduler has exited on this CPU.
+#define SCHED_EXITED   (1 << 3)
 
 // Things a thread can be blocked on.
 typedef enum {
     // Thread is blocked on a `mutex_t`.
     THREAD_BLOCK_MUTEX,
+    // Thread is blocked on a `waitqueue_t`.
+    THREAD_BLOCK_WAITQUEUE,
 } thread_block_t;
 
+// Earliest-deadline-first scheduling state of a thread.
+typedef struct {
+    // Runtime budget per period.
+    timestamp_us_t  runtime;
+    // Length of a period, or 0 if the thread is in the normal class.
+    timestamp_us_t  period;
+    // Deadline of the current period; the budget is replenished at this time.
+    timestamp_us_t  deadline;
+    // Runtime used in the current period.
+    timestamp_us_t  used;
+    // CPU utilization reserved by this thread in 0.01% increments.
+    int             util;
+    // CPU on which the utilization is reserved.
+    int             cpu;
+    // Affinity to restore when the thread leaves the EDF class.
+    sched_cpumask_t affinity;
+} sched_edf_t;
+
 // Thread struct.
 struct sched_thread_t {
     // Thread queue link.
     dlist_node_t node;
 
     // Process to which this thread belongs.
-    process_t  *process;
+    process_t        *process;
     // Lowest address of the kernel stack.
-    size_t      kernel_stack_bottom;
+    size_t            kernel_stack_bottom;
     // Highest address of the kernel stack.
-    size_t      kernel_stack_top;
+    size_t            kernel_stack_top;
     // Priority of this thread.
-    int         priority;
+    int               priority;
+    // Priority inherited from threads waiting on mutexes this thread holds, or 0 if none.
+    atomic_int        inherited_prio;
+    // Number of mutexes this thread holds exclusively.
+    atomic_int        mutexes_held;
+    // CPUs this thread is allowed to run on.
+    sched_cpumask_t   affinity;
+    // Earliest-deadline-first scheduling state.
+    sched_edf_t       edf;
+    // Runqueue priority level this thread was queued at, or -1 for the EDF queue.
+    int               queue_prio;
+    // CPU whose runqueue this thread is in, or NULL if not queued.
+    sched_cpulocal_t *queue_cpu;
     // Time usage information.
-    timeusage_t timeusage;
+    timeusage_t       timeusage;
+    // Time at which the thread was last woken up, or 0 if it has since run.
+    timestamp_us_t    wake_time;
+    // Time at which the thread last stopped running.
+    timestamp_us_t    last_ran;
+    // CPU the thread last ran on.
+    int               last_cpu;
+    // Time at which the thread was last moved to another CPU by work stealing.
+    timestamp_us_t    migrated_at;
 
     // Thread flags.
     atomic_int     flags;
     // Exit code from `thread_exit`
     int            exit_code;
+    // Threads waiting in `thread_join` for this thread to exit.
+    waitqueue_t    join_queue;
+    // Number of threads in `thread_join` on this thread; it is not reaped while this is nonzero.
+    atomic_int     joiners;
     // Cause for the thread to block. Only valid if THREAD_BLOCKED flag is set.
     thread_block_t blocked_by;
+    // Incremented every time the thread blocks on a wait queue.
+    uint32_t       waitqueue_gen;
+    // Value of `waitqueue_gen` when the timer was last armed for a wait queue timeout.
+    uint32_t       waitqueue_timer_gen;
+    // Timer used for sleeping and for blocking with a timeout.
+    timer_node_t   timer;
     // Information for the object the thread is blocking on.
     union {
         // Info for threads blocked on a mutex.
         struct {
             // Pointer to blocking mutex.
             mutex_t *mutex;
-            // Timer ID used by mutex timeout code.
-            int64_t  timer_id;
+            // Whether the thread is waiting for a share.
+            bool     shared;
+            // Set if the thread was woken as part of a batch of shares.
+            bool     granted;
         } mutex;
+        // Info for threads blocked on a wait queue.
+        struct {
+            // Pointer to blocking wait queue.
+            waitqueue_t *queue;
+            // Set if the thread was resumed by the timeout.
+            bool         timed_out;
+        } waitqueue;
     } blocking_obj;
 
     // ISR context for threads running in kernel mode.
@@ -109,23 +191,47 @@ struct sched_thread_t {
 // CPU-local scheduler data.
 struct sched_cpulocal_t {
     // Scheduler start/stop mutex.
-    mutex_t        run_mtx;
+    mutex_t          run_mtx;
     // Incoming threads list mutex.
-    mutex_t        incoming_mtx;
+    mutex_t          incoming_mtx;
     // Threads pending handover to this CPU.
-    dlist_t        incoming;
-    // CPU-local thread queue.
-    dlist_t        queue;
+    dlist_t          incoming;
+    // Thread pool mutex.
+    mutex_t          pool_mtx;
+    // Unused thread handles whose kernel stacks are still allocated.
+    dlist_t          pool;
+    // Fewest handles in `pool` since the last trim; that many were not needed and will be freed.
+    size_t           pool_low;
+    // Spinlock guarding the runqueue against other CPUs stealing work.
+    atomic_flag      queue_lock;
+    // Bitmap of non-empty priority levels in `queue`.
+    uint32_t         queue_bitmap;
+    // Number of threads in the runqueue.
+    atomic_int       queue_len;
+    // CPU-local thread queues, one per priority level.
+    dlist_t          queue[SCHED_PRIO_LEVELS];
+    // Queue of earliest-deadline-first threads; these run before any thread in `queue`.
+    dlist_t          edf_queue;
+    // Utilization reserved by EDF threads on this CPU in 0.01% increments.
+    atomic_int       edf_util;
+    // Earliest time at which a throttled EDF thread on this CPU gets its budget back.
+    timestamp_us_t   edf_replenish;
+    // Thread selected to run on this CPU; it is never stolen by other CPUs.
+    sched_thread_t  *current;
     // CPU-local scheduler state flags.
-    atomic_int     flags;
+    atomic_int       flags;
     // Last preemption time.
-    timestamp_us_t last_preempt;
+    timestamp_us_t   last_preempt;
     // Time until next measurement interval.
-    timestamp_us_t load_measure_time;
+    timestamp_us_t   load_measure_time;
     // CPU load average in 0.01% increments.
-    atomic_int     load_average;
+    atomic_int       load_average;
     // CPU load estimate in 0.01% increments.
-    atomic_int     load_estimate;
+    atomic_int       load_estimate;
+    // Wake-to-run latency statistics.
+    sched_wakestat_t wakestat;
+    // Total time spent halted by the idle thread.
+    timestamp_us_t   idle_residency;
     // Idle thread.
-    sched_thread_t idle_thread;
+    sched_thread_t   idle_thread;
 };
@@ -31,3 +31,7 @@ bool   smp_pause();
 bool   smp_resume(int cpu);
 // Whether a CPU can be powered off at runtime.
 bool   smp_can_poweroff(int cpu);
+// Request another CPU to run its scheduler, if supported.
+bool   smp_resched(int cpu);
+// Whether `smp_resched` is supported.
+bool   smp_has_resched();
@@ -55,3 +55,14 @@ bool smp_can_poweroff(int cpu) {
     (void)cpu;
     return false;
 }
+
+// Request another CPU to run its scheduler, if supported.
+bool smp_resched(int cpu) {
+    (void)cpu;
+    return false;
+}
+
+// Whether `smp_resched` is supported.
+bool smp_has_resched() {
+    return false;
+}
@@ -106,3 +106,14 @@ bool smp_resume(int cpu) {
 bool smp_can_poweroff(int cpu) {
     return cpu == 1;
 }
+
+// Request another CPU to run its scheduler, if supported.
+bool smp_resched(int cpu) {
+    (void)cpu;
+    return false;
+}
+
+// Whether `smp_resched` is supported.
+bool smp_has_resched() {
+    return false;
+}
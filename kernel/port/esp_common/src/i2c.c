@@ -7,6 +7,7 @@
 #include "hal/gpio.h"
 #include "interrupt.h"
 #include "scheduler/scheduler.h"
+#include "waitqueue.h"
 
 #include <config.h>
 
@@ -61,6 +62,7 @@ typedef struct {
     int            sda_pin;
     int            scl_pin;
     atomic_int     busy;
+    waitqueue_t    done;
     bool           is_master;
     bool           enabled;
     i2c_fsm_cmd_t *cmd;
@@ -171,6 +173,7 @@ static void i2c_isr_trans_done(int i2c_num) {
     if (i2c_ctx[i2c_num].cur_cmd >= i2c_ctx[i2c_num].cmd_len) {
         i2c_ll_clear_intr_mask(I2C_DEV, I2C_LL_INTR_MST_COMPLETE);
         atomic_store(&i2c_ctx[i2c_num].busy, false);
+        waitqueue_notify(&i2c_ctx[i2c_num].done);
         return;
     }
     // If there are, queue them up.
@@ -395,12 +398,18 @@ static size_t i2c_sync_trans(badge_err_t *ec, int i2c_num, i2c_fsm_cmd_t *cmd, s
     asm("");
     logkf(LOG_DEBUG, "SR: %{u32;x}", sr);
     timestamp_us_t timeout = time_us() + 100000;
-    while (atomic_load(&i2c_ctx[i2c_num].busy) && time_us() < timeout) {
-        if (time_us() > timeout) {
+    while (1) {
+        // Sampled before checking for completion so the notification from the ISR is not missed.
+        int seq = waitqueue_seq(&i2c_ctx[i2c_num].done);
+        if (!atomic_load(&i2c_ctx[i2c_num].busy)) {
+            break;
+        }
+        timestamp_us_t now = time_us();
+        if (now >= timeout) {
             badge_err_set(ec, ELOC_I2C, ECAUSE_TIMEOUT);
             return i2c_ctx[i2c_num].trans_bytes;
         }
-        thread_yield();
+        waitqueue_block(&i2c_ctx[i2c_num].done, seq, timeout - now);
     }
     logkf(LOG_DEBUG, "SR: %{u32;x}", I2C0.sr.val);
 
@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: MIT
+
+#include "condvar.h"
+
+#include "assertions.h"
+
+
+
+// Recommended way to create a condition variable at run-time.
+void condvar_init(condvar_t *cond) {
+    *cond = CONDVAR_T_INIT;
+}
+
+// Clean up the condition variable.
+// There must be no threads waiting on it.
+void condvar_destroy(condvar_t *cond) {
+    waitqueue_destroy(&cond->waiters);
+}
+
+
+
+// Release `mutex` and wait at most `max_wait_us` microseconds for `cond` to be signalled.
+// `mutex` must be held exclusively by the caller and is re-acquired before returning.
+// If `max_wait_us` is too long or negative, do not use the timeout.
+// Returns false if the timeout expired, true otherwise; spurious wakeups are possible.
+bool condvar_wait(condvar_t *cond, mutex_t *mutex, timestamp_us_t max_wait_us) {
+    // Sampled while `mutex` is held so a signal sent after releasing it is not missed.
+    int seq = waitqueue_seq(&cond->waiters);
+    assert_dev_keep(mutex_release(NULL, mutex));
+    bool res = waitqueue_block(&cond->waiters, seq, max_wait_us);
+    assert_dev_keep(mutex_acquire(NULL, mutex, TIMESTAMP_US_MAX));
+    return res;
+}
+
+// Wake up one thread waiting on `cond`.
+void condvar_signal(condvar_t *cond) {
+    waitqueue_notify(&cond->waiters);
+}
+
+// Wake up all threads waiting on `cond`.
+void condvar_broadcast(condvar_t *cond) {
+    waitqueue_notify_all(&cond->waiters);
+}
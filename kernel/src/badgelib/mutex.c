@@ -6,21 +6,27 @@
 #include "assertions.h"
 #include "cpu/isr.h"
 #include "interrupt.h"
+#include "lockprof_private.h"
 #include "log.h"
 #include "scheduler/isr.h"
 #include "scheduler/scheduler.h"
+#include "scheduler/trace.h"
 #include "scheduler/types.h"
 #include "smp.h"
 #include "time.h"
 
 // Magic value for exclusive locking.
 #define EXCLUSIVE_MAGIC ((int)__INT_MAX__ / 4)
+// Maximum length of a chain of mutex owners that priority is inherited through.
+#define MUTEX_PI_DEPTH  8
+// Maximum time in microseconds to spin while the owner of a mutex is running on another CPU before blocking.
+#define MUTEX_SPIN_US   20
 
 
 
 // Recommended way to create a mutex at run-time.
 void mutex_init(badge_err_t *ec, mutex_t *mutex, bool shared, bool allow_isr) {
-    *mutex = ((mutex_t){shared, allow_isr, ATOMIC_FLAG_INIT, 0, {0}});
+    *mutex = ((mutex_t){shared, allow_isr, ATOMIC_FLAG_INIT, 0, 0, {0}, 0, 0, 0, 0, 0, 0});
     atomic_thread_fence(memory_order_release);
     badge_err_set_ok(ec);
 }
@@ -29,6 +35,7 @@ void mutex_init(badge_err_t *ec, mutex_t *mutex, bool shared, bool allow_isr) {
 void mutex_destroy(badge_err_t *ec, mutex_t *mutex) {
     // The mutex must always be completely unlocked to guarantee no threads are waiting on it.
     assert_always(mutex->shares == 0);
+    assert_always(mutex->excl_waiting == 0);
     assert_dev_drop(!atomic_flag_test_and_set(&mutex->wait_spinlock));
     badge_err_set_ok(ec);
 }
@@ -59,22 +66,102 @@ static void mutex_resume_timer(void *cookie) {
     irq_enable_if(ie);
 }
 
+// Record the current thread as the exclusive owner of `mutex`.
+static void mutex_set_owner(mutex_t *mutex) {
+    sched_thread_t *self = sched_current_thread();
+    mutex->owner         = self;
+    mutex->acquired_at   = time_us();
+    mutex->acquires++;
+    if (self) {
+        atomic_fetch_add(&self->mutexes_held, 1);
+    }
+}
+
+// Clear the exclusive owner of `mutex`.
+// The owner loses its inherited priority once it no longer holds any mutexes.
+static void mutex_clear_owner(mutex_t *mutex) {
+    sched_thread_t *owner  = mutex->owner;
+    mutex->owner           = NULL;
+    if (mutex->acquired_at) {
+        mutex->hold_time   += time_us() - mutex->acquired_at;
+        mutex->acquired_at  = 0;
+    }
+    if (owner && atomic_fetch_sub(&owner->mutexes_held, 1) == 1) {
+        atomic_store(&owner->inherited_prio, 0);
+    }
+}
+
+// Boost the owner of `mutex`, and the owners of the mutexes it is blocked on, to at least `prio`.
+// Interrupts must be disabled.
+static void mutex_boost_owners(mutex_t *mutex, int prio) {
+    for (int i = 0; i < MUTEX_PI_DEPTH; i++) {
+        sched_thread_t *owner = mutex->owner;
+        if (!owner || thread_effective_prio(owner) >= prio) {
+            return;
+        }
+        int cur = atomic_load(&owner->inherited_prio);
+        while (cur < prio && !atomic_compare_exchange_weak(&owner->inherited_prio, &cur, prio));
+        if (mutex->owner != owner && !atomic_load(&owner->mutexes_held)) {
+            // The owner released the mutex in the meantime; undo the boost.
+            int boosted = prio;
+            atomic_compare_exchange_strong(&owner->inherited_prio, &boosted, 0);
+            return;
+        }
+        // Make the new priority take effect if the owner is waiting in a runqueue.
+        thread_requeue(owner);
+
+        // Follow the chain if the owner is itself waiting for a mutex.
+        if (!(atomic_load_explicit(&owner->flags, memory_order_acquire) & THREAD_BLOCKED)
+            || owner->blocked_by != THREAD_BLOCK_MUTEX) {
+            return;
+        }
+        mutex = owner->blocking_obj.mutex.mutex;
+    }
+}
+
+// Whether a thread waiting for `mutex` could take it right now.
+static bool mutex_available(mutex_t *mutex, bool shared) {
+    int shares = atomic_load(&mutex->shares);
+    if (shared) {
+        return shares < EXCLUSIVE_MAGIC - 1 && !atomic_load(&mutex->excl_waiting);
+    } else {
+        return shares == 0;
+    }
+}
+
+// Spin until `spin_limit` while the exclusive owner of `mutex` is running on another CPU.
+// Returns whether the mutex may have become available in the meantime.
+static bool mutex_spin(mutex_t *mutex, timestamp_us_t spin_limit, bool shared) {
+    sched_thread_t *owner = mutex->owner;
+    if (!owner || !thread_running_elsewhere(owner) || time_us() >= spin_limit) {
+        // The owner is unknown or won't release the mutex until it is scheduled again.
+        return false;
+    }
+    atomic_fetch_add_explicit(&mutex->spins, 1, memory_order_relaxed);
+    while (mutex->owner == owner && thread_running_elsewhere(owner) && time_us() < spin_limit) {
+        isr_pause();
+    }
+    return mutex_available(mutex, shared);
+}
+
 // Mutex awaiting implementation.
-static void mutex_wait(mutex_t *mutex, timestamp_us_t timeout) {
+// Returns whether the thread was woken as part of a batch of threads waiting for a share.
+static bool mutex_wait(mutex_t *mutex, timestamp_us_t timeout, bool shared) {
+    atomic_fetch_add_explicit(&mutex->blocks, 1, memory_order_relaxed);
     // Disable IRQs because of multiple IRQ spinlocks in use here.
     irq_disable();
     // Pause the execution of this thread.
     sched_thread_t *self = thread_dequeue_self();
 
-    atomic_fetch_or(&self->flags, THREAD_BLOCKED);
-    self->blocked_by               = THREAD_BLOCK_MUTEX;
-    self->blocking_obj.mutex.mutex = mutex;
+    // Fill in the block before it is visible through the flag; `mutex_boost_owners` follows it from other CPUs.
+    self->blocked_by                 = THREAD_BLOCK_MUTEX;
+    self->blocking_obj.mutex.mutex   = mutex;
+    self->blocking_obj.mutex.shared  = shared;
+    self->blocking_obj.mutex.granted = false;
+    atomic_fetch_or_explicit(&self->flags, THREAD_BLOCKED, memory_order_release);
     if (timeout < TIMESTAMP_US_MAX) {
         // Set timeout interrupt for mutex.
-        self->blocking_obj.mutex.timer_id = time_add_async_task(time_us() + timeout, mutex_resume_timer, self);
-    } else {
-        // No timeout; no timer interrupt is added.
-        self->blocking_obj.mutex.timer_id = -1;
+        assert_dev_keep(time_add_timer(&self->timer, timeout, mutex_resume_timer, self));
     }
 
     // Add thread to mutex waiting list.
@@ -82,77 +169,153 @@ static void mutex_wait(mutex_t *mutex, timestamp_us_t timeout) {
     dlist_append(&mutex->waiting_list, &self->node);
     atomic_flag_clear_explicit(&mutex->wait_spinlock, memory_order_release);
 
+    SCHED_TRACE(SCHEDTRACE_BLOCK, self->id, shared);
+
+    // Lend this thread's priority to the owner of the mutex.
+    mutex_boost_owners(mutex, thread_effective_prio(self));
+
+    if (mutex_available(mutex, shared)) {
+        // The mutex was released after the caller checked; don't block.
+        int flags = atomic_fetch_and(&self->flags, ~THREAD_BLOCKED);
+        if (flags & THREAD_BLOCKED) {
+            while (atomic_flag_test_and_set_explicit(&mutex->wait_spinlock, memory_order_acquire));
+            dlist_remove(&mutex->waiting_list, &self->node);
+            atomic_flag_clear_explicit(&mutex->wait_spinlock, memory_order_release);
+            time_cancel_timer(&self->timer);
+            thread_handoff(self, smp_cur_cpu(), true, 0);
+        }
+    }
+
     // Switch to some other still runnable thread.
     thread_yield();
+    return self->blocking_obj.mutex.granted;
 }
 
-// Notify the first waiting thread of the mutex being released.
+// Notify waiting threads of the mutex being released.
+// If the first waiting thread wants exclusive access, only that thread is woken.
+// Otherwise, all consecutive threads waiting for a share are woken in one batch.
 static void mutex_notify(mutex_t *mutex) {
+    int shares = atomic_load(&mutex->shares);
+    if (shares >= EXCLUSIVE_MAGIC) {
+        // Taken exclusively again; the new owner will notify on release.
+        return;
+    }
+
     bool ie = irq_disable();
     while (atomic_flag_test_and_set_explicit(&mutex->wait_spinlock, memory_order_acquire));
 
-    dlist_node_t *node = mutex->waiting_list.head;
+    dlist_t       woken = DLIST_EMPTY;
+    dlist_node_t *node  = mutex->waiting_list.head;
     while (node) {
-        // Try to pop the first thread from the list.
         sched_thread_t *thread = (sched_thread_t *)node;
-        int             flags  = atomic_fetch_and(&thread->flags, ~THREAD_BLOCKED);
-        if (flags & THREAD_BLOCKED) {
-            // If blocked flag was still set, we won the race with the timer.
-            // Remove thread from the waiting list.
-            dlist_remove(&mutex->waiting_list, node);
-            atomic_flag_clear_explicit(&mutex->wait_spinlock, memory_order_release);
-
-            // Cancel the timer.
-            if (thread->blocking_obj.mutex.timer_id != -1) {
-                time_cancel_async_task(thread->blocking_obj.mutex.timer_id);
-            }
-
-            // Resume the thread.
-            thread_handoff(thread, smp_cur_cpu(), true, 0);
-            irq_enable_if(ie);
-            return;
-
-        } else {
+        bool            shared = thread->blocking_obj.mutex.shared;
+        node                   = node->next;
+        if (!shared && (woken.len || shares)) {
+            // The batch of shares ends at the first exclusive waiter.
+            break;
+        }
+        int flags = atomic_fetch_and(&thread->flags, ~THREAD_BLOCKED);
+        if (!(flags & THREAD_BLOCKED)) {
             // We lost the race with the timer; try the next thread.
-            node = node->next;
+            continue;
+        }
+        // If blocked flag was still set, we won the race with the timer.
+        dlist_remove(&mutex->waiting_list, &thread->node);
+        time_cancel_timer(&thread->timer);
+        thread->blocking_obj.mutex.granted = shared;
+        dlist_append(&woken, &thread->node);
+        SCHED_TRACE(SCHEDTRACE_WAKE, thread->id, shared);
+        if (!shared) {
+            break;
         }
     }
 
-    // We lost all the races or there were no threads in the waiting list.
     atomic_flag_clear_explicit(&mutex->wait_spinlock, memory_order_release);
+
+    // Resume the threads.
+    thread_handoff_list(&woken, smp_cur_cpu());
     irq_enable_if(ie);
 }
 
-// Atomically await the expected value and swap in the new value.
-static inline bool await_swap_atomic_int(
-    mutex_t *mutex, timestamp_us_t timeout, int expected, int new_value, memory_order order, bool from_isr
-) {
+// Atomically await the mutex to be unlocked and then lock it exclusively.
+// Threads spin for a bounded time while the owner is running on another CPU before blocking.
+static inline bool await_lock_atomic_int(mutex_t *mutex, timestamp_us_t timeout, bool from_isr) {
+    bool           waiting    = false;
+    bool           success    = false;
+    timestamp_us_t spin_limit = 0;
     do {
-        int old_value = expected;
-        if (atomic_compare_exchange_weak_explicit(&mutex->shares, &old_value, new_value, order, memory_order_relaxed)) {
-            return true;
+        int old_value = 0;
+        if (atomic_compare_exchange_weak_explicit(
+                &mutex->shares,
+                &old_value,
+                EXCLUSIVE_MAGIC,
+                memory_order_acquire,
+                memory_order_relaxed
+            )) {
+            success = true;
+            break;
         } else if (from_isr) {
             isr_pause();
         } else {
-            mutex_wait(mutex, timeout);
+            if (!spin_limit) {
+                spin_limit = time_us() + MUTEX_SPIN_US;
+                spin_limit = spin_limit < timeout ? spin_limit : timeout;
+            }
+            if (mutex_spin(mutex, spin_limit, false)) {
+                // The owner released the mutex while spinning; try to take it without blocking.
+                continue;
+            }
+            if (!waiting) {
+                // Stop new shares from being taken while waiting.
+                atomic_fetch_add(&mutex->excl_waiting, 1);
+                waiting = true;
+            }
+            mutex_wait(mutex, timeout, false);
         }
     } while (time_us() < timeout);
-    return false;
+
+    if (waiting) {
+        atomic_fetch_sub(&mutex->excl_waiting, 1);
+        if (!success) {
+            // Let threads that deferred to this one take their shares.
+            mutex_notify(mutex);
+        }
+    }
+    return success;
 }
 
 // Atomically check the value does not exceed a threshold and add 1.
+// Threads not running in an ISR defer to threads waiting for exclusive access,
+// unless they were woken as part of a batch of shares.
 static inline bool
     thresh_add_atomic_int(mutex_t *mutex, timestamp_us_t timeout, int threshold, memory_order order, bool from_isr) {
-    int old_value = atomic_load(&mutex->shares);
+    bool           granted    = false;
+    timestamp_us_t spin_limit = 0;
     do {
-        int new_value = old_value + 1;
-        if (!(old_value >= threshold || new_value >= threshold) &&
-            atomic_compare_exchange_weak_explicit(&mutex->shares, &old_value, new_value, order, memory_order_relaxed)) {
-            return true;
-        } else if (from_isr) {
+        int old_value = atomic_load(&mutex->shares);
+        while (old_value < threshold - 1 && (from_isr || granted || !atomic_load(&mutex->excl_waiting))) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &mutex->shares,
+                    &old_value,
+                    old_value + 1,
+                    order,
+                    memory_order_relaxed
+                )) {
+                return true;
+            }
+        }
+        if (from_isr) {
             isr_pause();
         } else {
-            mutex_wait(mutex, timeout);
+            if (!spin_limit) {
+                spin_limit = time_us() + MUTEX_SPIN_US;
+                spin_limit = spin_limit < timeout ? spin_limit : timeout;
+            }
+            if (!granted && mutex_spin(mutex, spin_limit, true)) {
+                // The owner released the mutex while spinning; try to take a share without blocking.
+                continue;
+            }
+            granted = mutex_wait(mutex, timeout, true);
         }
     } while (time_us() < timeout);
     return false;
@@ -189,8 +352,11 @@ static bool mutex_acquire_impl(badge_err_t *ec, mutex_t *mutex, timestamp_us_t t
         timeout += now;
     }
     // Await the shared portion to reach 0 and then lock.
-    if (await_swap_atomic_int(mutex, timeout, 0, EXCLUSIVE_MAGIC, memory_order_acquire, from_isr)) {
+    if (await_lock_atomic_int(mutex, timeout, from_isr)) {
         // If that succeeds, the mutex was acquired.
+        if (!from_isr) {
+            mutex_set_owner(mutex);
+        }
         badge_err_set_ok(ec);
         return true;
     } else {
@@ -205,7 +371,15 @@ static bool mutex_acquire_impl(badge_err_t *ec, mutex_t *mutex, timestamp_us_t t
 static bool mutex_release_impl(badge_err_t *ec, mutex_t *mutex, bool from_isr) {
     assert_dev_drop(!from_isr || mutex->allow_isr);
     assert_dev_drop(atomic_load(&mutex->shares) >= EXCLUSIVE_MAGIC);
-    if (await_swap_atomic_int(mutex, TIMESTAMP_US_MAX, EXCLUSIVE_MAGIC, 0, memory_order_release, from_isr)) {
+    mutex_clear_owner(mutex);
+    int old_value = EXCLUSIVE_MAGIC;
+    if (atomic_compare_exchange_strong_explicit(
+            &mutex->shares,
+            &old_value,
+            0,
+            memory_order_release,
+            memory_order_relaxed
+        )) {
         // Successful release.
         mutex_notify(mutex);
         badge_err_set_ok(ec);
@@ -252,34 +426,86 @@ static bool mutex_release_shared_impl(badge_err_t *ec, mutex_t *mutex, bool from
         badge_err_set(ec, ELOC_UNKNOWN, ECAUSE_ILLEGAL);
         return false;
     } else {
-        // Successful release.
-        mutex_notify(mutex);
+        // Successful release; waiting threads can only continue once the last share is released.
+        if (atomic_load(&mutex->shares) == 0) {
+            mutex_notify(mutex);
+        }
         badge_err_set_ok(ec);
         return true;
     }
 }
 
 
+#if CONFIG_LOCK_PROFILE
+// Acquire `mutex` exclusively or shared and record the acquisition from `site` in the lock profiler.
+static bool mutex_acquire_profiled(
+    badge_err_t *ec, mutex_t *mutex, timestamp_us_t max_wait_us, bool shared, bool from_isr, void const *site
+) {
+    timestamp_us_t start     = time_us();
+    bool           contended = !mutex_available(mutex, shared);
+    bool           success;
+    if (shared) {
+        success = mutex_acquire_shared_impl(ec, mutex, max_wait_us, from_isr);
+    } else {
+        success = mutex_acquire_impl(ec, mutex, max_wait_us, from_isr);
+    }
+    if (success) {
+        lockprof_acquired(mutex, site, LOCKPROF_MUTEX, contended, time_us() - start);
+    }
+    return success;
+}
+#endif
+
+// Get the contention statistics of `mutex`.
+// The statistics are updated without synchronization and are only approximate.
+mutex_stats_t mutex_get_stats(mutex_t const *mutex) {
+    mutex_stats_t stats = {
+        .spins    = atomic_load_explicit(&mutex->spins, memory_order_relaxed),
+        .blocks   = atomic_load_explicit(&mutex->blocks, memory_order_relaxed),
+        .acquires = mutex->acquires,
+    };
+    if (stats.acquires) {
+        stats.avg_hold_time = mutex->hold_time / stats.acquires;
+    }
+    return stats;
+}
+
+
+
 // Try to acquire `mutex` within `max_wait_us` microseconds.
 // If `max_wait_us` is too long or negative, do not use the timeout.
 // Returns true if the mutex was successully acquired.
 bool mutex_acquire(badge_err_t *ec, mutex_t *mutex, timestamp_us_t max_wait_us) {
+#if CONFIG_LOCK_PROFILE
+    return mutex_acquire_profiled(ec, mutex, max_wait_us, false, false, __builtin_return_address(0));
+#else
     return mutex_acquire_impl(ec, mutex, max_wait_us, false);
+#endif
 }
 // Release `mutex`, if it was initially acquired by this thread.
 // Returns true if the mutex was successfully released.
 bool mutex_release(badge_err_t *ec, mutex_t *mutex) {
+#if CONFIG_LOCK_PROFILE
+    lockprof_released(mutex);
+#endif
     return mutex_release_impl(ec, mutex, false);
 }
 // Try to acquire `mutex` within `max_wait_us` microseconds.
 // If `max_wait_us` is too long or negative, do not use the timeout.
 // Returns true if the mutex was successully acquired.
 bool mutex_acquire_from_isr(badge_err_t *ec, mutex_t *mutex, timestamp_us_t max_wait_us) {
+#if CONFIG_LOCK_PROFILE
+    return mutex_acquire_profiled(ec, mutex, max_wait_us, false, true, __builtin_return_address(0));
+#else
     return mutex_acquire_impl(ec, mutex, max_wait_us, true);
+#endif
 }
 // Release `mutex`, if it was initially acquired by this thread.
 // Returns true if the mutex was successfully released.
 bool mutex_release_from_isr(badge_err_t *ec, mutex_t *mutex) {
+#if CONFIG_LOCK_PROFILE
+    lockprof_released(mutex);
+#endif
     return mutex_release_impl(ec, mutex, true);
 }
 
@@ -287,21 +513,35 @@ bool mutex_release_from_isr(badge_err_t *ec, mutex_t *mutex) {
 // If `max_wait_us` is too long or negative, do not use the timeout.
 // Returns true if the share was successfully acquired.
 bool mutex_acquire_shared(badge_err_t *ec, mutex_t *mutex, timestamp_us_t max_wait_us) {
+#if CONFIG_LOCK_PROFILE
+    return mutex_acquire_profiled(ec, mutex, max_wait_us, true, false, __builtin_return_address(0));
+#else
     return mutex_acquire_shared_impl(ec, mutex, max_wait_us, false);
+#endif
 }
 // Release `mutex`, if it was initially acquired by this thread.
 // Returns true if the mutex was successfully released.
 bool mutex_release_shared(badge_err_t *ec, mutex_t *mutex) {
+#if CONFIG_LOCK_PROFILE
+    lockprof_released(mutex);
+#endif
     return mutex_release_shared_impl(ec, mutex, false);
 }
 // Try to acquire a share in `mutex` within `max_wait_us` microseconds.
 // If `max_wait_us` is too long or negative, do not use the timeout.
 // Returns true if the share was successfully acquired.
 bool mutex_acquire_shared_from_isr(badge_err_t *ec, mutex_t *mutex, timestamp_us_t max_wait_us) {
+#if CONFIG_LOCK_PROFILE
+    return mutex_acquire_profiled(ec, mutex, max_wait_us, true, true, __builtin_return_address(0));
+#else
     return mutex_acquire_shared_impl(ec, mutex, max_wait_us, true);
+#endif
 }
 // Release `mutex`, if it was initially acquired by this thread.
 // Returns true if the mutex was successfully released.
 bool mutex_release_shared_from_isr(badge_err_t *ec, mutex_t *mutex) {
+#if CONFIG_LOCK_PROFILE
+    lockprof_released(mutex);
+#endif
     return mutex_release_shared_impl(ec, mutex, true);
 }
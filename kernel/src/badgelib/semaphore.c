@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: MIT
+
+#include "semaphore.h"
+
+#include "assertions.h"
+
+
+
+// Recommended way to create a semaphore at run-time.
+void semaphore_init(semaphore_t *sem, int value) {
+    assert_dev_drop(value >= 0);
+    *sem = SEMAPHORE_T_INIT(value);
+}
+
+// Clean up the semaphore.
+// There must be no threads waiting on it.
+void semaphore_destroy(semaphore_t *sem) {
+    waitqueue_destroy(&sem->waiters);
+}
+
+
+
+// Try to take a unit from `sem` within `max_wait_us` microseconds.
+// If `max_wait_us` is too long or negative, do not use the timeout.
+// Returns true if a unit was successfully taken.
+bool semaphore_wait(semaphore_t *sem, timestamp_us_t max_wait_us) {
+    // Compute timeout.
+    timestamp_us_t now     = time_us();
+    timestamp_us_t timeout = TIMESTAMP_US_MAX;
+    if (max_wait_us >= 0 && max_wait_us - TIMESTAMP_US_MAX + now < 0) {
+        timeout = now + max_wait_us;
+    }
+
+    while (1) {
+        int seq = waitqueue_seq(&sem->waiters);
+        if (semaphore_trywait(sem)) {
+            return true;
+        }
+        if (timeout == TIMESTAMP_US_MAX) {
+            waitqueue_block(&sem->waiters, seq, -1);
+            continue;
+        }
+        now = time_us();
+        if (now >= timeout) {
+            return false;
+        }
+        waitqueue_block(&sem->waiters, seq, timeout - now);
+    }
+}
+
+// Try to take a unit from `sem` without blocking.
+// Returns true if a unit was successfully taken.
+bool semaphore_trywait(semaphore_t *sem) {
+    int value = atomic_load(&sem->value);
+    while (value > 0) {
+        if (atomic_compare_exchange_weak_explicit(
+                &sem->value,
+                &value,
+                value - 1,
+                memory_order_acquire,
+                memory_order_relaxed
+            )) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Add a unit to `sem` and wake up a waiting thread, if any.
+// May be called from an ISR.
+void semaphore_post(semaphore_t *sem) {
+    atomic_fetch_add_explicit(&sem->value, 1, memory_order_release);
+    waitqueue_notify(&sem->waiters);
+}
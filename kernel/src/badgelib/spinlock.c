@@ -4,6 +4,7 @@
 #include "spinlock.h"
 
 #include "assertions.h"
+#include "lockprof_private.h"
 
 #define SPINLOCK_EXCL_MAGIC (-__INT_MAX__ - 1)
 
@@ -11,16 +12,26 @@
 
 // Take the spinlock exclusively.
 void spinlock_take(spinlock_t *lock) {
+#if CONFIG_LOCK_PROFILE
+    timestamp_us_t start     = time_us();
+    bool           contended = atomic_load_explicit(lock, memory_order_relaxed) & ~1;
+#endif
     int cur = atomic_load_explicit(lock, memory_order_acquire);
     int next;
     do {
         cur  &= 1;
         next  = cur | SPINLOCK_EXCL_MAGIC;
     } while (!atomic_compare_exchange_weak_explicit(lock, &cur, next, memory_order_acquire, memory_order_relaxed));
+#if CONFIG_LOCK_PROFILE
+    lockprof_acquired(lock, __builtin_return_address(0), LOCKPROF_SPINLOCK, contended, time_us() - start);
+#endif
 }
 
 // Release the spinlock exclusively.
 void spinlock_release(spinlock_t *lock) {
+#if CONFIG_LOCK_PROFILE
+    lockprof_released(lock);
+#endif
     int res = atomic_fetch_and_explicit(lock, 1, memory_order_release);
     assert_dev_drop(res < 0);
 }
@@ -28,6 +39,10 @@ void spinlock_release(spinlock_t *lock) {
 // Take the spinlock shared.
 void spinlock_take_shared(spinlock_t *lock) {
     assert_dev_drop(atomic_load_explicit(lock, memory_order_relaxed) & 1);
+#if CONFIG_LOCK_PROFILE
+    timestamp_us_t start     = time_us();
+    bool           contended = atomic_load_explicit(lock, memory_order_relaxed) < 0;
+#endif
     int cur = atomic_load_explicit(lock, memory_order_acquire);
     int next;
     do {
@@ -36,10 +51,16 @@ void spinlock_take_shared(spinlock_t *lock) {
         }
         next = cur + 2;
     } while (!atomic_compare_exchange_weak_explicit(lock, &cur, next, memory_order_acquire, memory_order_relaxed));
+#if CONFIG_LOCK_PROFILE
+    lockprof_acquired(lock, __builtin_return_address(0), LOCKPROF_SPINLOCK, contended, time_us() - start);
+#endif
 }
 
 // Release the spinlock shared.
 void spinlock_release_shared(spinlock_t *lock) {
+#if CONFIG_LOCK_PROFILE
+    lockprof_released(lock);
+#endif
     int res = atomic_fetch_sub(lock, 2);
     assert_dev_drop(res >= 2);
 }
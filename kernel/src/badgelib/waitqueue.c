@@ -0,0 +1,168 @@
+// SPDX-License-Identifier: MIT
+
+#include "waitqueue.h"
+
+#include "assertions.h"
+#include "interrupt.h"
+#include "scheduler/isr.h"
+#include "scheduler/scheduler.h"
+#include "scheduler/types.h"
+#include "smp.h"
+
+#include <limits.h>
+
+
+
+// Recommended way to create a wait queue at run-time.
+void waitqueue_init(waitqueue_t *queue) {
+    *queue = WAITQUEUE_T_INIT;
+}
+
+// Clean up the wait queue.
+// There must be no threads waiting on it.
+void waitqueue_destroy(waitqueue_t *queue) {
+    assert_always(queue->waiting_list.len == 0);
+    assert_dev_drop(!atomic_flag_test_and_set(&queue->wait_spinlock));
+}
+
+
+
+// Remove a thread from the waiting list and resume it.
+// The caller must have won the race to clear its THREAD_BLOCKED flag.
+static void waitqueue_resume(waitqueue_t *queue, sched_thread_t *thread) {
+    while (atomic_flag_test_and_set_explicit(&queue->wait_spinlock, memory_order_acquire));
+    dlist_remove(&queue->waiting_list, &thread->node);
+    atomic_flag_clear_explicit(&queue->wait_spinlock, memory_order_release);
+    thread_handoff(thread, smp_cur_cpu(), true, 0);
+}
+
+// Wait queue resume by timer.
+static void waitqueue_resume_timer(void *cookie) {
+    sched_thread_t *thread = cookie;
+    if (thread->blocked_by != THREAD_BLOCK_WAITQUEUE || thread->waitqueue_gen != thread->waitqueue_timer_gen) {
+        // Timeout of a block that already ended; the thread may be blocked on something else by now.
+        return;
+    }
+    // Disable IRQs because of multiple IRQ spinlocks in use here.
+    bool ie = irq_disable();
+
+    int flags = atomic_fetch_and(&thread->flags, ~THREAD_BLOCKED);
+    if (flags & THREAD_BLOCKED) {
+        // If blocked flag was still set, we won the race with the notifier.
+        thread->blocking_obj.waitqueue.timed_out = true;
+        waitqueue_resume(thread->blocking_obj.waitqueue.queue, thread);
+    }
+
+    // Re-enable interrupts.
+    irq_enable_if(ie);
+}
+
+// Get the notification counter of `queue`, to be passed to `waitqueue_block`.
+// Must be read before checking the condition that is being waited for.
+int waitqueue_seq(waitqueue_t *queue) {
+    return atomic_load(&queue->seq);
+}
+
+// Block on `queue` for at most `max_wait_us` microseconds.
+// Returns immediately if `queue` was notified after `seq` was read.
+// If `max_wait_us` is too long or negative, do not use the timeout.
+// Returns false if the timeout expired, true otherwise.
+bool waitqueue_block(waitqueue_t *queue, int seq, timestamp_us_t max_wait_us) {
+    if (max_wait_us == 0) {
+        return atomic_load(&queue->seq) != seq;
+    }
+    // Compute timeout.
+    timestamp_us_t now     = time_us();
+    timestamp_us_t timeout = TIMESTAMP_US_MAX;
+    if (max_wait_us > 0 && max_wait_us - TIMESTAMP_US_MAX + now < 0) {
+        timeout = now + max_wait_us;
+    }
+
+    // Disable IRQs because of multiple IRQ spinlocks in use here.
+    irq_disable();
+    // Pause the execution of this thread.
+    sched_thread_t *self = thread_dequeue_self();
+
+    // Fill in the block before it is visible through the flag.
+    self->blocked_by                       = THREAD_BLOCK_WAITQUEUE;
+    self->blocking_obj.waitqueue.queue     = queue;
+    self->blocking_obj.waitqueue.timed_out = false;
+    self->waitqueue_gen++;
+    atomic_fetch_or(&self->flags, THREAD_BLOCKED);
+    if (timeout < TIMESTAMP_US_MAX) {
+        // Set timeout interrupt for the wait queue.
+        self->waitqueue_timer_gen = self->waitqueue_gen;
+        assert_dev_keep(time_add_timer(&self->timer, timeout, waitqueue_resume_timer, self));
+    }
+
+    // Add thread to the waiting list.
+    while (atomic_flag_test_and_set_explicit(&queue->wait_spinlock, memory_order_acquire));
+    dlist_append(&queue->waiting_list, &self->node);
+    atomic_flag_clear_explicit(&queue->wait_spinlock, memory_order_release);
+
+    if (atomic_load(&queue->seq) != seq) {
+        // Notified after the caller checked its condition; don't block.
+        int flags = atomic_fetch_and(&self->flags, ~THREAD_BLOCKED);
+        if (flags & THREAD_BLOCKED) {
+            time_cancel_timer(&self->timer);
+            waitqueue_resume(queue, self);
+        }
+    }
+
+    // Switch to some other still runnable thread.
+    thread_yield();
+    return !self->blocking_obj.waitqueue.timed_out;
+}
+
+// Wake up threads waiting on `queue`, stopping after `max` threads.
+// If `process` is not NULL, only threads belonging to it are woken up.
+static int waitqueue_notify_impl(waitqueue_t *queue, int max, process_t *process) {
+    // Disable IRQs because of multiple IRQ spinlocks in use here.
+    bool ie = irq_disable();
+    atomic_fetch_add(&queue->seq, 1);
+    while (atomic_flag_test_and_set_explicit(&queue->wait_spinlock, memory_order_acquire));
+
+    dlist_t       woken = DLIST_EMPTY;
+    dlist_node_t *node  = queue->waiting_list.head;
+    while (node && (int)woken.len < max) {
+        sched_thread_t *thread = (sched_thread_t *)node;
+        node                   = node->next;
+        if (process && thread->process != process) {
+            continue;
+        }
+        int flags = atomic_fetch_and(&thread->flags, ~THREAD_BLOCKED);
+        if (flags & THREAD_BLOCKED) {
+            // If blocked flag was still set, we won the race with the timer.
+            time_cancel_timer(&thread->timer);
+            dlist_remove(&queue->waiting_list, &thread->node);
+            dlist_append(&woken, &thread->node);
+        }
+    }
+
+    atomic_flag_clear_explicit(&queue->wait_spinlock, memory_order_release);
+
+    // Resume the threads.
+    int count = woken.len;
+    thread_handoff_list(&woken, smp_cur_cpu());
+    irq_enable_if(ie);
+    return count;
+}
+
+// Wake up the first thread waiting on `queue`.
+// Returns whether a thread was woken up.
+bool waitqueue_notify(waitqueue_t *queue) {
+    return waitqueue_notify_impl(queue, 1, NULL);
+}
+
+// Wake up all threads waiting on `queue`.
+// Returns the number of threads woken up.
+int waitqueue_notify_all(waitqueue_t *queue) {
+    return waitqueue_notify_impl(queue, INT_MAX, NULL);
+}
+
+// Wake up the threads waiting on `queue` that belong to `process`.
+// Threads of other processes about to block on `queue` may return early, like after any other notification.
+// Returns the number of threads woken up.
+int waitqueue_notify_process(waitqueue_t *queue, process_t *process) {
+    return waitqueue_notify_impl(queue, INT_MAX, process);
+}
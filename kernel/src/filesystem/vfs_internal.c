@@ -6,6 +6,7 @@
 #include "assertions.h"
 #include "badge_strings.h"
 #include "filesystem/vfs_ramfs.h"
+#include "kmem_cache.h"
 #include "log.h"
 #include "malloc.h"
 
@@ -32,6 +33,8 @@ vfs_file_shared_t **vfs_file_shared_list;
 size_t              vfs_file_shared_list_len;
 // Capacity of open shared file handles list.
 size_t              vfs_file_shared_list_cap;
+// Cache of shared file handles.
+static kmem_cache_t vfs_file_shared_cache = KMEM_CACHE_T_INIT("vfs_file_shared_t", vfs_file_shared_t, NULL, NULL);
 
 // List of open file handles.
 vfs_file_handle_t *vfs_file_handle_list;
@@ -93,12 +96,14 @@ static ptrdiff_t vfs_file_by_ptr(vfs_file_shared_t *ptr) {
     return -1;
 }
 
-// Splice a shared file handle out of the list.
+// Splice a shared file handle out of the list and free it.
 static void vfs_file_shared_splice(ptrdiff_t i) {
     // Remove an entry.
+    kmem_cache_free(&vfs_file_shared_cache, vfs_file_shared_list[i]);
     vfs_file_shared_list_len--;
-    if (vfs_file_shared_list_len) {
-        vfs_file_shared_list[i] = vfs_file_shared_list[vfs_file_shared_list_len];
+    if ((size_t)i < vfs_file_shared_list_len) {
+        vfs_file_shared_list[i]        = vfs_file_shared_list[vfs_file_shared_list_len];
+        vfs_file_shared_list[i]->index = i;
     }
 
     if (vfs_file_shared_list_cap > vfs_file_shared_list_len * 2) {
@@ -171,7 +176,7 @@ ptrdiff_t vfs_file_create_shared() {
 
     // Allocate new shared handle.
     ptrdiff_t          shared = (ptrdiff_t)vfs_file_shared_list_len;
-    vfs_file_shared_t *shptr  = malloc(sizeof(vfs_file_shared_t));
+    vfs_file_shared_t *shptr  = kmem_cache_alloc(&vfs_file_shared_cache);
     if (!shptr)
         return -1;
     *shptr = (vfs_file_shared_t){
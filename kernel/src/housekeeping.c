@@ -1,13 +1,17 @@
-
 // SPDX-License-Identifier: MIT
 
 #include "housekeeping.h"
 
 #include "arrays.h"
 #include "assertions.h"
+#include "log.h"
+#include "malloc.h"
 #include "mutex.h"
 #include "scheduler/scheduler.h"
+#include "scheduler/types.h"
+#include "smp.h"
 #include "stdatomic.h"
+#include "waitqueue.h"
 
 // Housekeeping task entry.
 typedef struct taskent_t taskent_t;
@@ -24,14 +28,28 @@ typedef struct taskent_t {
     void          *arg;
 } taskent_t;
 
-// Number of tasks.
-size_t     queue_len  = 0;
-// Capacity for tasks.
-size_t     queue_cap  = 0;
-// Tasks queue.
-taskent_t *queue      = NULL;
+// Housekeeping worker; there is one per CPU.
+typedef struct {
+    // Task queue mutex.
+    mutex_t     mtx;
+    // Notified when a task is added.
+    waitqueue_t wakeup;
+    // Number of tasks.
+    size_t      queue_len;
+    // Capacity for tasks.
+    size_t      queue_cap;
+    // Tasks queue.
+    taskent_t  *queue;
+    // Task number of the task currently running, or -1 if none.
+    int         running;
+    // Whether the task currently running was cancelled.
+    bool        running_cancelled;
+} hk_worker_t;
+
 // Task ID counter.
-int        taskno_ctr = 0;
+static atomic_int   taskno_ctr;
+// Per-CPU housekeeping workers.
+static hk_worker_t *workers;
 
 
 
@@ -46,72 +64,113 @@ int hk_task_time_cmp(void const *a, void const *b) {
     return 0;
 }
 
+// Allocate the workers if that hasn't happened yet.
+// Tasks may be added before `hk_init` while the booting CPU is the only one running.
+static void hk_alloc_workers() {
+    if (workers) {
+        return;
+    }
+    workers = malloc(smp_count * sizeof(hk_worker_t));
+    assert_always(workers);
+    for (int i = 0; i < smp_count; i++) {
+        workers[i] = (hk_worker_t){
+            .mtx     = MUTEX_T_INIT,
+            .wakeup  = WAITQUEUE_T_INIT,
+            .running = -1,
+        };
+    }
+}
 
 
-// The housekeeping thread handle.
-static tid_t   hk_thread;
-// Task mutex.
-static mutex_t hk_mtx = MUTEX_T_INIT;
 
-// Runs housekeeping tasks.
-int hk_thread_func(void *ignored) {
-    (void)ignored;
+// Runs housekeeping tasks for one CPU.
+int hk_worker_func(void *arg) {
+    hk_worker_t *worker = arg;
 
     while (1) {
-        mutex_acquire(NULL, &hk_mtx, TIMESTAMP_US_MAX);
-        timestamp_us_t now  = time_us();
-        taskent_t      task = {0};
+        // Sampled before checking the queue so no added task is missed.
+        int seq = waitqueue_seq(&worker->wakeup);
+        mutex_acquire(NULL, &worker->mtx, TIMESTAMP_US_MAX);
+        timestamp_us_t now = time_us();
 
         // Check all tasks.
-        while (queue_len && queue[0].next_time <= now) {
-            // Run the first task.
-            array_remove(queue, sizeof(taskent_t), queue_len, &task, 0);
+        while (worker->queue_len && worker->queue[0].next_time <= now) {
+            // Run the first task without holding the mutex so it can add or cancel tasks.
+            taskent_t task;
+            array_lencap_remove(&worker->queue, sizeof(taskent_t), &worker->queue_len, &worker->queue_cap, &task, 0);
             assert_dev_drop(task.callback != NULL);
+            worker->running           = task.taskno;
+            worker->running_cancelled = false;
+            mutex_release(NULL, &worker->mtx);
             task.callback(task.taskno, task.arg);
+            mutex_acquire(NULL, &worker->mtx, TIMESTAMP_US_MAX);
+            worker->running = -1;
 
-            if (task.interval > 0 && task.next_time <= TIMESTAMP_US_MAX - task.interval) {
+            if (!worker->running_cancelled && task.interval > 0 && task.next_time <= TIMESTAMP_US_MAX - task.interval) {
                 // Repeated tasks get put back into the queue.
                 task.next_time += task.interval;
-                array_sorted_insert(queue, sizeof(taskent_t), queue_len - 1, &task, hk_task_time_cmp);
-            } else {
-                // One-time tasks are removed.
-                queue_len--;
+                if (!array_lencap_sorted_insert(
+                        &worker->queue,
+                        sizeof(taskent_t),
+                        &worker->queue_len,
+                        &worker->queue_cap,
+                        &task,
+                        hk_task_time_cmp
+                    )) {
+                    logkf(LOG_ERROR, "Out of memory re-queueing housekeeping task %{d}", task.taskno);
+                }
             }
         }
 
-        mutex_release(NULL, &hk_mtx);
-        thread_yield();
+        // Sleep until the next task is due or another one is added.
+        timestamp_us_t timeout = -1;
+        if (worker->queue_len) {
+            timeout = worker->queue[0].next_time - time_us();
+            timeout = timeout > 0 ? timeout : 0;
+        }
+        mutex_release(NULL, &worker->mtx);
+        waitqueue_block(&worker->wakeup, seq, timeout);
     }
 }
 
 // Initialize the housekeeping system.
 void hk_init() {
     badge_err_t ec;
-    hk_thread = thread_new_kernel(&ec, "housekeeping", hk_thread_func, NULL, SCHED_PRIO_NORMAL);
-    badge_err_assert_always(&ec);
-    thread_resume(&ec, hk_thread);
-    badge_err_assert_always(&ec);
+    hk_alloc_workers();
+    for (int i = 0; i < smp_count; i++) {
+        tid_t thread = thread_new_kernel(&ec, "housekeeping", hk_worker_func, &workers[i], SCHED_PRIO_NORMAL);
+        badge_err_assert_always(&ec);
+        // Pin the worker to its CPU so tasks are run where they were added.
+        thread_set_affinity(&ec, thread, (sched_cpumask_t)1 << i);
+        badge_err_assert_always(&ec);
+        thread_resume(&ec, thread);
+        badge_err_assert_always(&ec);
+    }
 }
 
 
 
 // Add a one-time task with optional timestamp to the queue.
-// This task will be run in the "housekeeping" task.
+// This task will be run in the "housekeeping" worker of the calling CPU.
 // Returns the task number.
 int hk_add_once(timestamp_us_t time, hk_task_t task, void *arg) {
     return hk_add_repeated(time, 0, task, arg);
 }
 
 // Add a repeating task with optional start timestamp to the queue.
-// This task will be run in the "housekeeping" task.
+// This task will be run in the "housekeeping" worker of the calling CPU.
 // Returns the task number.
 int hk_add_repeated(timestamp_us_t time, timestamp_us_t interval, hk_task_t task, void *arg) {
     if (!task) {
         return -1;
     }
-    mutex_acquire(NULL, &hk_mtx, TIMESTAMP_US_MAX);
+    hk_alloc_workers();
 
-    int       taskno = taskno_ctr;
+    // Tasks are run by the worker of the CPU that added them.
+    hk_worker_t *worker = &workers[smp_cur_cpu()];
+    mutex_acquire(NULL, &worker->mtx, TIMESTAMP_US_MAX);
+
+    int       taskno = atomic_fetch_add(&taskno_ctr, 1);
     taskent_t ent    = {
            .next_time = time,
            .interval  = interval,
@@ -120,25 +179,52 @@ int hk_add_repeated(timestamp_us_t time, timestamp_us_t interval, hk_task_t task
            .arg       = arg,
     };
 
+    bool success;
     if (time <= 0) {
-        taskno_ctr += array_lencap_insert(&queue, sizeof(taskent_t), &queue_len, &queue_cap, &ent, 0);
+        success =
+            array_lencap_insert(&worker->queue, sizeof(taskent_t), &worker->queue_len, &worker->queue_cap, &ent, 0);
     } else {
-        taskno_ctr +=
-            array_lencap_sorted_insert(&queue, sizeof(taskent_t), &queue_len, &queue_cap, &ent, hk_task_time_cmp);
+        success = array_lencap_sorted_insert(
+            &worker->queue,
+            sizeof(taskent_t),
+            &worker->queue_len,
+            &worker->queue_cap,
+            &ent,
+            hk_task_time_cmp
+        );
+    }
+
+    mutex_release(NULL, &worker->mtx);
+    if (!success) {
+        return -1;
     }
 
-    mutex_release(NULL, &hk_mtx);
+    // Let the worker re-evaluate when to wake up.
+    waitqueue_notify(&worker->wakeup);
     return taskno;
 }
 
 // Cancel a housekeeping task.
 void hk_cancel(int taskno) {
-    mutex_acquire(NULL, &hk_mtx, TIMESTAMP_US_MAX);
-    for (size_t i = 0; i < queue_len; i++) {
-        if (queue[i].taskno == taskno) {
-            array_lencap_remove(&queue, sizeof(taskent_t), &queue_len, &queue_cap, NULL, i);
+    hk_alloc_workers();
+    for (int cpu = 0; cpu < smp_count; cpu++) {
+        hk_worker_t *worker = &workers[cpu];
+        bool         found  = false;
+        mutex_acquire(NULL, &worker->mtx, TIMESTAMP_US_MAX);
+        if (worker->running == taskno) {
+            // Task is running right now; prevent it from being repeated.
+            worker->running_cancelled = true;
+            found                     = true;
+        }
+        for (size_t i = 0; !found && i < worker->queue_len; i++) {
+            if (worker->queue[i].taskno == taskno) {
+                array_lencap_remove(&worker->queue, sizeof(taskent_t), &worker->queue_len, &worker->queue_cap, NULL, i);
+                found = true;
+            }
+        }
+        mutex_release(NULL, &worker->mtx);
+        if (found) {
             return;
         }
     }
-    mutex_release(NULL, &hk_mtx);
 }
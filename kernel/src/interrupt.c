@@ -3,6 +3,7 @@
 
 #include "assertions.h"
 #include "cpu/panic.h"
+#include "kmem_cache.h"
 #include "malloc.h"
 #include "spinlock.h"
 
@@ -24,20 +25,26 @@ struct isr_entry {
 };
 
 // Spinlock that prevents concurrent IRQ servicing and list modification.
-static spinlock_t isr_spinlock = SPINLOCK_T_INIT_SHARED;
+static spinlock_t   isr_spinlock = SPINLOCK_T_INIT_SHARED;
 // Array of ISR linked lists by IRQ number.
-static int        isr_list_len;
+static int          isr_list_len;
 // Array of ISR linked lists by IRQ number.
-static dlist_t   *isr_list;
+static dlist_t     *isr_list;
+// Cache of installed ISRs.
+static kmem_cache_t isr_cache = KMEM_CACHE_T_INIT("isr_entry_t", isr_entry_t, NULL, NULL);
 
 
 
 // Add an ISR to a certain IRQ.
 isr_handle_t isr_install(int irq, isr_t isr_func, void *cookie) {
     assert_dev_drop(irq >= 0);
-    isr_entry_t *entry = malloc(sizeof(isr_entry_t));
-    entry->isr         = isr_func;
-    entry->cookie      = cookie;
+    isr_entry_t *entry = kmem_cache_alloc(&isr_cache);
+    if (!entry) {
+        return NULL;
+    }
+    entry->irq    = irq;
+    entry->isr    = isr_func;
+    entry->cookie = cookie;
 
     bool ie = irq_disable();
     spinlock_take(&isr_spinlock);
@@ -47,7 +54,7 @@ isr_handle_t isr_install(int irq, isr_t isr_func, void *cookie) {
         if (!mem) {
             spinlock_release(&isr_spinlock);
             irq_enable_if(ie);
-            free(entry);
+            kmem_cache_free(&isr_cache, entry);
             return NULL;
         }
 
@@ -75,6 +82,8 @@ void isr_remove(isr_handle_t handle) {
 
     spinlock_release(&isr_spinlock);
     irq_enable_if(ie);
+
+    kmem_cache_free(&isr_cache, handle);
 }
 
 
@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: MIT
+
+#include "lockprof_private.h"
+
+#include "errno.h"
+#include "interrupt.h"
+#include "isr_ctx.h"
+#include "smp.h"
+#include "syscall_util.h"
+#include "usercopy.h"
+
+#if CONFIG_LOCK_PROFILE
+
+// Maximum number of CPUs that lock statistics are recorded for.
+#define LOCKPROF_MAX_CPUS 8
+// Maximum number of lock and call site pairs recorded per CPU.
+#define LOCKPROF_ENTRIES  128
+// Maximum number of locks per CPU whose hold time is tracked at once.
+#define LOCKPROF_HELD     16
+
+// Lock currently held on a CPU.
+typedef struct {
+    // Address of the lock.
+    void const    *lock;
+    // Thread that acquired the lock; it may have released it on another CPU since.
+    void const    *thread;
+    // Index of the statistics entry for this acquisition.
+    int            entry;
+    // Time at which the lock was acquired.
+    timestamp_us_t since;
+} lockprof_held_t;
+
+// Per-CPU lock profiler data.
+typedef struct {
+    // Open-addressed hash table of statistics per lock and call site.
+    lockprof_entry_t entries[LOCKPROF_ENTRIES];
+    // Locks held on this CPU, most recently acquired last.
+    lockprof_held_t  held[LOCKPROF_HELD];
+    // Number of locks in `held`.
+    int              held_len;
+} lockprof_cpu_t;
+
+// Per-CPU lock profiler data.
+// This is static because allocating it would take the very locks it profiles.
+static lockprof_cpu_t lockprof_cpus[LOCKPROF_MAX_CPUS];
+
+
+
+// Find or create the statistics entry for `lock` acquired from `site`.
+// Returns -1 if the table is full.
+static int lockprof_find(lockprof_cpu_t *prof, void const *lock, void const *site, int kind) {
+    size_t hash  = (size_t)lock ^ ((size_t)site * 0x9e3779b1);
+    hash        ^= hash >> 16;
+    for (int i = 0; i < LOCKPROF_ENTRIES; i++) {
+        int               index = (int)((hash + i) % LOCKPROF_ENTRIES);
+        lockprof_entry_t *ent   = &prof->entries[index];
+        if (!ent->lock) {
+            ent->lock = (size_t)lock;
+            ent->site = (size_t)site;
+            ent->kind = kind;
+            return index;
+        } else if (ent->lock == (size_t)lock && ent->site == (size_t)site) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+// Record an acquisition of `lock` from `site` that waited `wait` microseconds.
+void lockprof_acquired(void const *lock, void const *site, int kind, bool contended, timestamp_us_t wait) {
+    bool ie  = irq_disable();
+    int  cpu = smp_cur_cpu();
+    if (cpu < 0 || cpu >= LOCKPROF_MAX_CPUS) {
+        irq_enable_if(ie);
+        return;
+    }
+    lockprof_cpu_t *prof  = &lockprof_cpus[cpu];
+    int             index = lockprof_find(prof, lock, site, kind);
+    if (index >= 0) {
+        lockprof_entry_t *ent  = &prof->entries[index];
+        ent->acquisitions++;
+        ent->contended        += contended;
+        ent->wait_time        += wait;
+
+        if (prof->held_len == LOCKPROF_HELD) {
+            // Forget the oldest lock; it was most likely released on another CPU.
+            for (int i = 1; i < LOCKPROF_HELD; i++) {
+                prof->held[i - 1] = prof->held[i];
+            }
+            prof->held_len--;
+        }
+        prof->held[prof->held_len++] = (lockprof_held_t){lock, isr_ctx_get()->thread, index, time_us()};
+    }
+    irq_enable_if(ie);
+}
+
+// Record a release of `lock` by the current thread on this CPU.
+void lockprof_released(void const *lock) {
+    bool ie  = irq_disable();
+    int  cpu = smp_cur_cpu();
+    if (cpu < 0 || cpu >= LOCKPROF_MAX_CPUS) {
+        irq_enable_if(ie);
+        return;
+    }
+    lockprof_cpu_t *prof   = &lockprof_cpus[cpu];
+    void const     *thread = isr_ctx_get()->thread;
+    for (int i = prof->held_len - 1; i >= 0; i--) {
+        if (prof->held[i].lock != lock || prof->held[i].thread != thread) {
+            // Another lock, or an acquisition of this lock by another thread that was released on another CPU.
+            continue;
+        }
+        timestamp_us_t    hold = time_us() - prof->held[i].since;
+        lockprof_entry_t *ent  = &prof->entries[prof->held[i].entry];
+        if (hold > ent->max_hold_time) {
+            ent->max_hold_time = hold;
+        }
+        for (; i < prof->held_len - 1; i++) {
+            prof->held[i] = prof->held[i + 1];
+        }
+        prof->held_len--;
+        break;
+    }
+    irq_enable_if(ie);
+}
+
+#endif
+
+
+
+// Copy up to `cap` lock profiler entries to `entries`.
+// Returns the total number of entries recorded, or a (negative) errno on failure.
+int syscall_sys_lockprof(lockprof_entry_t *entries, int cap) {
+#if CONFIG_LOCK_PROFILE
+    if (cap < 0) {
+        return -EINVAL;
+    }
+    int total = 0;
+    for (int cpu = 0; cpu < smp_count && cpu < LOCKPROF_MAX_CPUS; cpu++) {
+        for (int i = 0; i < LOCKPROF_ENTRIES; i++) {
+            // Other CPUs keep updating their entries; the copy is only a snapshot.
+            lockprof_entry_t ent = lockprof_cpus[cpu].entries[i];
+            if (!ent.lock) {
+                continue;
+            }
+            if (total < cap) {
+                ent.cpu = cpu;
+                sigsegv_assert(
+                    copy_to_user(proc_current_pid(), (size_t)(entries + total), &ent, sizeof(ent)),
+                    (size_t)(entries + total)
+                );
+            }
+            total++;
+        }
+    }
+    return total;
+#else
+    (void)entries;
+    (void)cap;
+    return -ENOSYS;
+#endif
+}
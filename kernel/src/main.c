@@ -7,6 +7,7 @@
 #include "housekeeping.h"
 #include "interrupt.h"
 #include "isr_ctx.h"
+#include "kmem_cache.h"
 #include "log.h"
 #include "malloc.h"
 #include "memprotect.h"
@@ -207,4 +208,5 @@ static void userland_shutdown() {
 // When finished, the CPU continues to the platform-specific hardware shutdown / reboot handler.
 static void kernel_shutdown() {
     // TODO: Filesystems flush.
+    kmem_cache_log_stats();
 }
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: MIT
+
+// Multi-threaded malloc/free throughput benchmark.
+// Run it against the allocator with `LD_PRELOAD=./malloc.so ./bench`.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <time.h>
+
+#define BENCH_ITERATIONS  1000000
+#define BENCH_LIVE        64
+#define BENCH_MAX_THREADS 8
+
+// Randomly replace allocations of slab sizes, keeping `BENCH_LIVE` of them live.
+static void *bench_thread(void *arg) {
+    unsigned int seed             = (unsigned int)(size_t)arg;
+    void        *live[BENCH_LIVE] = {0};
+
+    for (int i = 0; i < BENCH_ITERATIONS; ++i) {
+        int slot = rand_r(&seed) % BENCH_LIVE;
+        free(live[slot]);
+        live[slot] = malloc(16 + rand_r(&seed) % 240);
+    }
+    for (int i = 0; i < BENCH_LIVE; ++i) {
+        free(live[i]);
+    }
+    return NULL;
+}
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main() {
+    for (int threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2) {
+        pthread_t handles[BENCH_MAX_THREADS];
+        double    start = now_seconds();
+        for (int i = 0; i < threads; ++i) {
+            pthread_create(&handles[i], NULL, bench_thread, (void *)(size_t)(i + 1));
+        }
+        for (int i = 0; i < threads; ++i) {
+            pthread_join(handles[i], NULL);
+        }
+        double elapsed = now_seconds() - start;
+        printf("%d thread(s): %.2f M malloc+free/s\n", threads, threads * (BENCH_ITERATIONS / 1e6) / elapsed);
+        fflush(stdout);
+    }
+    return 0;
+}
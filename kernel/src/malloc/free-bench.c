@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: MIT
+
+// Free latency benchmark with the maximum number of memory pools.
+// Pages and slab objects are spread over all pools and freed in random order.
+
+#include "static-buddy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <time.h>
+
+#define BENCH_POOL_SIZE (PAGE_SIZE * 2048)
+#define BENCH_ROUNDS    5
+#define BENCH_OBJ_SIZE  64
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void shuffle(void **ptrs, size_t len) {
+    for (size_t i = len - 1; i > 0; --i) {
+        size_t j = rand() % (i + 1);
+        void  *t = ptrs[i];
+        ptrs[i]  = ptrs[j];
+        ptrs[j]  = t;
+    }
+}
+
+int main() {
+    srand(1);
+    for (int i = 0; i < MAX_MEMORY_POOLS; ++i) {
+        char *ram = malloc(BENCH_POOL_SIZE);
+        init_pool(ram, ram + BENCH_POOL_SIZE, 0);
+    }
+    init_kernel_slabs();
+
+    size_t cap  = (size_t)MAX_MEMORY_POOLS * BENCH_POOL_SIZE / BENCH_OBJ_SIZE;
+    void **ptrs = malloc(cap * sizeof(void *));
+    double page_best = 1e9, slab_best = 1e9;
+
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        // Single pages until all pools are full.
+        size_t len = 0;
+        while ((ptrs[len] = buddy_allocate(PAGE_SIZE, BLOCK_TYPE_PAGE, 0))) {
+            len++;
+        }
+        shuffle(ptrs, len);
+        double start = now_seconds();
+        for (size_t i = 0; i < len; ++i) {
+            buddy_deallocate(ptrs[i]);
+        }
+        double ns = (now_seconds() - start) * 1e9 / len;
+        if (ns < page_best) {
+            page_best = ns;
+        }
+
+        // Slab objects until all pools are full.
+        len = 0;
+        while (len < cap && (ptrs[len] = slab_allocate(BENCH_OBJ_SIZE, SLAB_TYPE_SLAB, 0))) {
+            len++;
+        }
+        shuffle(ptrs, len);
+        start = now_seconds();
+        for (size_t i = 0; i < len; ++i) {
+            slab_deallocate(ptrs[i]);
+        }
+        ns = (now_seconds() - start) * 1e9 / len;
+        if (ns < slab_best) {
+            slab_best = ns;
+        }
+    }
+
+    printf("%d pools: %.1f ns per page free, %.1f ns per slab free\n", memory_pool_num, page_best, slab_best);
+    free(ptrs);
+    return 0;
+}
@@ -0,0 +1,292 @@
+// SPDX-License-Identifier: MIT
+
+/* Object caches for BadgerOS
+ *
+ * An object cache hands out objects of one type from slabs of their exact size,
+ * instead of rounding them up to the next general purpose slab size.
+ *
+ * Objects are constructed once, when their slab is created, and destroyed once,
+ * when their slab is released. In between they are kept in their constructed state,
+ * so anything the constructor sets up (locks, lists, buffers) is reused as-is by
+ * the next allocation.
+ *
+ * Each slab starts with a header holding a stack of free object indices, followed by
+ * the objects. Slabs span multiple pages when that wastes less memory; every page of
+ * a slab points to the first one in the buddy allocator so the header can be found.
+ *
+ * Like the general purpose slabs, every cache keeps at most one empty slab around.
+ */
+
+#ifndef BADGEROS_KERNEL
+#define _GNU_SOURCE
+#endif
+
+#include "kmem_cache.h"
+
+#include "debug.h"
+#include "spinlock.h"
+#include "static-buddy.h"
+
+#ifdef BADGEROS_KERNEL
+#include "malloc.h"
+#else
+// The standalone tests run the allocator without `malloc.c`.
+#define kernel_heap_alloc_cache_pages(size) buddy_allocate(size, BLOCK_TYPE_CACHE, 0)
+#define kernel_heap_free_cache_pages(ptr)   buddy_deallocate(ptr)
+#endif
+
+// Maximum number of pages per slab.
+#define KMEM_MAX_SLAB_PAGES 8
+
+// Header at the start of an object cache slab.
+struct kmem_slab {
+    // Previous slab in the cache's list.
+    kmem_slab_t  *prev;
+    // Next slab in the cache's list.
+    kmem_slab_t  *next;
+    // Cache this slab belongs to.
+    kmem_cache_t *cache;
+    // Number of free objects.
+    uint16_t      free_len;
+    // Stack of indices of free objects.
+    uint16_t      free[];
+};
+
+// Spinlock guarding the list of caches.
+static atomic_flag   caches_lock = ATOMIC_FLAG_INIT;
+// List of caches that have been used.
+static kmem_cache_t *caches;
+
+
+
+// Add a slab to the front of a list.
+static void slab_push(kmem_slab_t **list, kmem_slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+// Add a slab to the back of a list.
+static void slab_push_back(kmem_slab_t **list, kmem_slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = NULL;
+    while (*list) {
+        slab->prev = *list;
+        list       = &(*list)->next;
+    }
+    *list = slab;
+}
+
+// Remove a slab from a list.
+static void slab_remove(kmem_slab_t **list, kmem_slab_t *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// Get the address of object `index` of a slab.
+static inline void *slab_obj(kmem_cache_t *cache, kmem_slab_t *slab, size_t index) {
+    return (uint8_t *)slab + cache->first + index * cache->stride;
+}
+
+// Compute the slab layout of a cache and add it to the list of caches.
+// Uses the smallest slab of at most `KMEM_MAX_SLAB_PAGES` pages that wastes no more than an eighth of its size.
+static void cache_setup(kmem_cache_t *cache) {
+    size_t align  = cache->align ? cache->align : sizeof(void *);
+    cache->stride = (size_t)ALIGN_UP(cache->size ? cache->size : 1, align);
+
+    for (size_t pages = 1; pages <= KMEM_MAX_SLAB_PAGES; pages *= 2) {
+        size_t bytes = pages * PAGE_SIZE;
+        size_t objs  = (bytes - sizeof(kmem_slab_t)) / (cache->stride + sizeof(uint16_t));
+        size_t first = (size_t)ALIGN_UP(sizeof(kmem_slab_t) + objs * sizeof(uint16_t), align);
+        while (objs && first + objs * cache->stride > bytes) {
+            objs--;
+            first = (size_t)ALIGN_UP(sizeof(kmem_slab_t) + objs * sizeof(uint16_t), align);
+        }
+        if (objs > UINT16_MAX) {
+            objs = UINT16_MAX;
+        }
+        cache->slab_pages = pages;
+        cache->slab_objs  = objs;
+        cache->first      = first;
+        if (objs && bytes - objs * cache->stride <= bytes / 8) {
+            break;
+        }
+    }
+    if (!cache->slab_objs) {
+        BADGEROS_MALLOC_MSG_ERROR("Objects of cache " FMT_S " don't fit in a slab", cache->name);
+    }
+
+    SPIN_LOCK_LOCK(caches_lock);
+    cache->next = caches;
+    caches      = cache;
+    SPIN_LOCK_UNLOCK(caches_lock);
+    cache->ready = true;
+}
+
+// Release a slab, destroying all of its objects.
+static void slab_destroy(kmem_cache_t *cache, kmem_slab_t *slab, size_t constructed) {
+    if (cache->dtor) {
+        for (size_t i = 0; i < constructed; ++i) {
+            cache->dtor(slab_obj(cache, slab, i));
+        }
+    }
+    kernel_heap_free_cache_pages(slab);
+}
+
+// Allocate a new slab and construct all of its objects.
+static kmem_slab_t *slab_create(kmem_cache_t *cache) {
+    if (!cache->slab_objs) {
+        return NULL;
+    }
+    kmem_slab_t *slab = kernel_heap_alloc_cache_pages(cache->slab_pages * PAGE_SIZE);
+    if (!slab) {
+        return NULL;
+    }
+    slab->cache    = cache;
+    slab->free_len = cache->slab_objs;
+
+    for (size_t i = 0; i < cache->slab_objs; ++i) {
+        if (cache->ctor && !cache->ctor(slab_obj(cache, slab, i))) {
+            slab_destroy(cache, slab, i);
+            return NULL;
+        }
+        // The lowest objects are handed out first.
+        slab->free[i] = cache->slab_objs - 1 - i;
+    }
+    return slab;
+}
+
+// Allocate a constructed object from `cache`.
+// Returns NULL if out of memory or if the constructor failed.
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    SPIN_LOCK_LOCK(cache->lock);
+    if (!cache->ready) {
+        cache_setup(cache);
+    }
+
+    kmem_slab_t *slab = cache->partial;
+    if (!slab) {
+        // Constructors may allocate memory themselves, so don't hold the lock while creating a slab.
+        SPIN_LOCK_UNLOCK(cache->lock);
+        slab = slab_create(cache);
+        if (!slab) {
+            return NULL;
+        }
+        SPIN_LOCK_LOCK(cache->lock);
+        slab_push(&cache->partial, slab);
+        cache->empty++;
+        cache->stats.slabs++;
+        cache->stats.pages += cache->slab_pages;
+        cache->stats.objs  += cache->slab_objs;
+    }
+
+    if (slab->free_len == cache->slab_objs) {
+        cache->empty--;
+    }
+    void *obj = slab_obj(cache, slab, slab->free[--slab->free_len]);
+    if (!slab->free_len) {
+        slab_remove(&cache->partial, slab);
+        slab_push(&cache->full, slab);
+    }
+    cache->stats.active++;
+    cache->stats.allocs++;
+    SPIN_LOCK_UNLOCK(cache->lock);
+
+    return obj;
+}
+
+// Return an object to `cache`.
+// The object must be back in its constructed state.
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!obj) {
+        return;
+    }
+    // The slab can't be released while it has allocated objects, so this is safe without the lock.
+    kmem_slab_t *slab  = buddy_get_start(ALIGN_PAGE_DOWN(obj));
+    size_t       index = ((size_t)obj - (size_t)slab - cache->first) / cache->stride;
+    BADGEROS_MALLOC_ASSERT_ERROR(slab && slab->cache == cache, "Object " FMT_P " not from cache " FMT_S, obj, cache->name);
+
+    SPIN_LOCK_LOCK(cache->lock);
+    if (slab->free_len == cache->slab_objs) {
+        SPIN_LOCK_UNLOCK(cache->lock);
+        BADGEROS_MALLOC_MSG_ERROR("kmem_cache_free(" FMT_P ") = Double free", obj);
+        return;
+    }
+    if (!slab->free_len) {
+        // Slabs that were full are the fullest of the partial slabs.
+        slab_remove(&cache->full, slab);
+        slab_push(&cache->partial, slab);
+    }
+    slab->free[slab->free_len++] = index;
+    cache->stats.active--;
+    cache->stats.frees++;
+
+    if (slab->free_len == cache->slab_objs) {
+        if (cache->empty) {
+            // This cache already has an empty slab; release this one.
+            slab_remove(&cache->partial, slab);
+            cache->stats.slabs--;
+            cache->stats.pages -= cache->slab_pages;
+            cache->stats.objs  -= cache->slab_objs;
+        } else {
+            // Keep the empty slab, but only use it once the slabs that are in use are full.
+            cache->empty++;
+            slab_remove(&cache->partial, slab);
+            slab_push_back(&cache->partial, slab);
+            slab = NULL;
+        }
+    } else {
+        slab = NULL;
+    }
+    SPIN_LOCK_UNLOCK(cache->lock);
+
+    if (slab) {
+        slab_destroy(cache, slab, cache->slab_objs);
+    }
+}
+
+// Get a snapshot of the statistics of `cache`.
+void kmem_cache_get_stats(kmem_cache_t *cache, kmem_cache_stats_t *stats) {
+    SPIN_LOCK_LOCK(cache->lock);
+    *stats = cache->stats;
+    SPIN_LOCK_UNLOCK(cache->lock);
+}
+
+// Log the statistics of all object caches that have been used.
+void kmem_cache_log_stats() {
+    SPIN_LOCK_LOCK(caches_lock);
+    kmem_cache_t *cache = caches;
+    SPIN_LOCK_UNLOCK(caches_lock);
+
+    // Caches are only ever added to the front of the list, so it can be walked without the lock.
+    for (; cache; cache = cache->next) {
+        kmem_cache_stats_t stats;
+        kmem_cache_get_stats(cache, &stats);
+        BADGEROS_MALLOC_DEBUG_MSG(
+#ifdef BADGEROS_KERNEL
+            LOG_INFO,
+#else
+            "INFO",
+#endif
+            FMT_S ": " FMT_ZI " B objects, " FMT_ZI " / " FMT_ZI " in use, " FMT_ZI " slabs (" FMT_ZI
+                  " pages), " FMT_ZI " allocs, " FMT_ZI " frees",
+            cache->name,
+            cache->size,
+            stats.active,
+            stats.objs,
+            stats.slabs,
+            stats.pages,
+            stats.allocs,
+            stats.frees
+        );
+    }
+}
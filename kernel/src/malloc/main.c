@@ -1,3 +1,4 @@
+#include "kmem_cache.h"
 #include "static-buddy.h"
 
 #include <stdio.h>
@@ -8,6 +9,25 @@
 #define PAGE_SIZE   4096
 #define MEMORY_SIZE PAGE_SIZE * 65536
 
+// Object type with an odd size for the object cache test.
+typedef struct {
+    uint64_t magic;
+    char     data[91];
+} test_obj_t;
+
+static size_t test_ctors, test_dtors;
+
+static bool test_obj_ctor(void *obj) {
+    ((test_obj_t *)obj)->magic = 0x5AFE;
+    test_ctors++;
+    return true;
+}
+
+static void test_obj_dtor(void *obj) {
+    ((test_obj_t *)obj)->magic = 0;
+    test_dtors++;
+}
+
 int main() {
     srand(time(NULL));
     char *ram  = malloc(MEMORY_SIZE);
@@ -69,10 +89,10 @@ int main() {
 
 #define SLAB_ALLOCATIONS (MEMORY_SIZE / 128) * 2
     char **slab_allocations = calloc(1, sizeof(void *) * SLAB_ALLOCATIONS);
-    int    slab_sizes[]     = {32, 64, 128, 256};
+    int    slab_sizes[]     = {32, 64, 128, 256, 384, 512, 1024, 1500, 2048};
 
     for (int i = 0; i < SLAB_ALLOCATIONS; ++i) {
-        int slab_size       = slab_sizes[abs(rand() % 4)];
+        int slab_size       = slab_sizes[abs(rand() % 9)];
         slab_allocations[i] = slab_allocate(slab_size, SLAB_TYPE_SLAB, 0);
     }
 
@@ -82,10 +102,88 @@ int main() {
 
     slab_deallocate(slab_allocations[0]);
 
+    // Slab allocations are naturally aligned to their size class.
+#define ALIGN_ALLOCATIONS 512
+    void **align_allocations = calloc(ALIGN_ALLOCATIONS, sizeof(void *));
+    for (size_t size = 1; size <= MAX_SLAB_SIZE; ++size) {
+        size_t slab_size = 32;
+        while (slab_size < size) {
+            slab_size *= 2;
+        }
+        for (int i = 0; i < ALIGN_ALLOCATIONS; ++i) {
+            align_allocations[i] = slab_allocate(size, SLAB_TYPE_SLAB, 0);
+            if (!align_allocations[i] || (size_t)align_allocations[i] % slab_size) {
+                printf("Slab allocation of %zu bytes not aligned to %zu: %p\n", size, slab_size, align_allocations[i]);
+                return 1;
+            }
+        }
+        for (int i = 0; i < ALIGN_ALLOCATIONS; ++i) {
+            slab_deallocate(align_allocations[i]);
+        }
+    }
+
+    // Buddy allocations are aligned to any power of two the pools are aligned to.
+    uint8_t align_order = memory_pools[0].align_order;
+    for (int p = 1; p < memory_pool_num; ++p) {
+        if (memory_pools[p].align_order > align_order) {
+            align_order = memory_pools[p].align_order;
+        }
+    }
+    // Each allocation is freed right away; keeping them all would run out of aligned blocks at the highest alignments.
+    for (size_t align = 1; align <= (size_t)PAGE_SIZE << (align_order + 2); align *= 2) {
+        for (size_t size = 1; size <= 16 * PAGE_SIZE; size += size < 2 * PAGE_SIZE ? 509 : PAGE_SIZE) {
+            void *ptr = buddy_allocate_aligned(size, align, BLOCK_TYPE_PAGE, 0);
+            if (!ptr && align <= (size_t)PAGE_SIZE << align_order) {
+                printf("Buddy allocation of %zu bytes aligned to %zu failed\n", size, align);
+                return 1;
+            }
+            if (!ptr) {
+                continue;
+            }
+            if ((size_t)ptr % align || (size_t)ptr % PAGE_SIZE || buddy_get_size(ptr) < size) {
+                printf("Buddy allocation of %zu bytes not aligned to %zu: %p\n", size, align, ptr);
+                return 1;
+            }
+            buddy_deallocate(ptr);
+        }
+    }
+    free(align_allocations);
+
+    // Object caches hand out constructed objects of their exact size and destroy them when their slab is released.
+    static kmem_cache_t test_cache = KMEM_CACHE_T_INIT("test_obj_t", test_obj_t, test_obj_ctor, test_obj_dtor);
+#define CACHE_ALLOCATIONS 4096
+    test_obj_t **cache_allocations = calloc(CACHE_ALLOCATIONS, sizeof(void *));
+    for (int i = 0; i < CACHE_ALLOCATIONS; ++i) {
+        cache_allocations[i] = kmem_cache_alloc(&test_cache);
+        if (!cache_allocations[i] || cache_allocations[i]->magic != 0x5AFE ||
+            (size_t)cache_allocations[i] % _Alignof(test_obj_t)) {
+            printf("Object cache allocation %d invalid: %p\n", i, cache_allocations[i]);
+            return 1;
+        }
+    }
+    kmem_cache_stats_t stats;
+    kmem_cache_get_stats(&test_cache, &stats);
+    if (stats.active != CACHE_ALLOCATIONS || stats.objs != test_ctors ||
+        stats.pages * PAGE_SIZE > stats.objs * sizeof(test_obj_t) * 9 / 8 + PAGE_SIZE) {
+        printf("Object cache statistics wrong\n");
+        return 1;
+    }
+    for (int i = 0; i < CACHE_ALLOCATIONS; ++i) {
+        kmem_cache_free(&test_cache, cache_allocations[i]);
+    }
+    kmem_cache_get_stats(&test_cache, &stats);
+    if (stats.active || stats.slabs > 1 || test_ctors - test_dtors != stats.objs) {
+        printf("Object cache didn't release its slabs\n");
+        return 1;
+    }
+    kmem_cache_log_stats();
+    free(cache_allocations);
+
     for (int p = 0; p < memory_pool_num; ++p) {
         memory_pool_t *pool = &memory_pools[p];
 
-        if (pool->free_pages < pool->pages - 4) {
+        // Every slab size and the object cache may keep one empty slab of up to 8 pages.
+        if (pool->free_pages < pool->pages - 8 * 8) {
             print_allocator();
             printf("Didn't free all pages\n");
             return 1;
@@ -16,6 +16,10 @@
 #include <config.h>
 
 #ifdef BADGEROS_KERNEL
+#include "errno.h"
+#include "interrupt.h"
+#include "smp.h"
+
 // NOLINTBEGIN
 extern char __start_free_sram[];
 extern char __stop_free_sram[];
@@ -30,6 +34,8 @@ extern char __stop_free_sram[];
 // NOLINTEND
 
 #else
+#include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -56,8 +62,66 @@ void *__real_reallocarray(void *ptr, size_t nmemb, size_t size);
 // NOLINTEND
 #endif
 
-static bool        mem_initialized = false;
-static atomic_flag lock            = ATOMIC_FLAG_INIT;
+// Maximum number of objects a magazine caches.
+#define MAG_SIZE     32
+// Maximum number of bytes a magazine caches; limits the magazines of larger size classes.
+#define MAG_BYTES    8192
+// Number of slab size classes, from 32 up to `MAX_SLAB_SIZE` bytes.
+#define MAG_CLASSES  7
+// Maximum number of CPUs with their own magazines.
+#define MAG_MAX_CPUS 8
+// Number of magazines per slab size class in the depot shared by all CPUs.
+#define MAG_DEPOT    8
+
+// Cache of free objects of one slab size class.
+typedef struct {
+    // Number of objects in `objs`.
+    int   count;
+    // Cached objects, most recently freed last.
+    void *objs[MAG_SIZE];
+} magazine_t;
+
+// Magazines of one CPU; aligned so CPUs don't share cache lines.
+typedef struct __attribute__((aligned(64))) {
+#ifndef BADGEROS_KERNEL
+    // Threads may move between CPUs on the host, so magazines need a (rarely contended) lock.
+    atomic_flag lock;
+#endif
+    // Value of `mag_drain_gen` when this CPU last flushed its magazines.
+    uint32_t    drain_gen;
+    // Magazine objects are allocated from and freed to, per slab size class.
+    magazine_t *loaded[MAG_CLASSES];
+    // Spare magazine per slab size class; it is always either full or empty.
+    magazine_t *previous[MAG_CLASSES];
+    // Storage for the magazines this CPU starts with.
+    magazine_t  mags[MAG_CLASSES][2];
+} magazine_cpu_t;
+
+// Full and empty magazines of one slab size class that CPUs exchange for their own.
+// Exchanges are always one magazine for another, so the depot holds `MAG_DEPOT` magazines in total.
+typedef struct {
+    // Number of magazines in `full`.
+    int         full_count;
+    // Number of magazines in `empty`.
+    int         empty_count;
+    // Full magazines.
+    magazine_t *full[MAG_DEPOT];
+    // Empty magazines.
+    magazine_t *empty[MAG_DEPOT];
+} magazine_depot_t;
+
+static bool             mem_initialized = false;
+static atomic_flag      lock            = ATOMIC_FLAG_INIT;
+static magazine_cpu_t   mag_cpus[MAG_MAX_CPUS];
+// Guards `mag_depot`; taken after a CPU's magazines and before `lock`.
+static atomic_flag      depot_lock = ATOMIC_FLAG_INIT;
+static magazine_depot_t mag_depot[MAG_CLASSES];
+// Storage for the magazines the depot starts with.
+static magazine_t       mag_depot_mags[MAG_CLASSES][MAG_DEPOT];
+// Incremented to make every CPU flush its magazines on its next magazine operation.
+static atomic_uint      mag_drain_gen;
+
+static void mag_init();
 
 void kernel_heap_init();
 
@@ -67,6 +131,7 @@ void kernel_heap_init() {
     init_pool(__start_free_sram, __stop_free_sram, 0);
 #endif
     init_kernel_slabs();
+    mag_init();
 #else
     SPIN_LOCK_LOCK(lock);
     if (mem_initialized) {
@@ -79,6 +144,7 @@ void kernel_heap_init() {
     void *mem_end   = sbrk(0);
     init_pool(mem_start, mem_end, 0);
     init_kernel_slabs();
+    mag_init();
     SPIN_LOCK_UNLOCK(lock);
 #endif
 
@@ -97,43 +163,296 @@ void *_malloc(size_t size) {
     return buddy_allocate(size, BLOCK_TYPE_PAGE, 0);
 }
 
+// Give every CPU and the depot their initial magazines.
+static void mag_init() {
+    for (int cpu = 0; cpu < MAG_MAX_CPUS; cpu++) {
+        for (int class = 0; class < MAG_CLASSES; class++) {
+            mag_cpus[cpu].loaded[class]   = &mag_cpus[cpu].mags[class][0];
+            mag_cpus[cpu].previous[class] = &mag_cpus[cpu].mags[class][1];
+        }
+    }
+    for (int class = 0; class < MAG_CLASSES; class++) {
+        for (int i = 0; i < MAG_DEPOT; i++) {
+            mag_depot[class].empty[i] = &mag_depot_mags[class][i];
+        }
+        mag_depot[class].empty_count = MAG_DEPOT;
+    }
+}
+
+// Return all objects in a magazine to the slab layer.
+// The caller must hold `lock`.
+static void mag_flush(magazine_t *mag) {
+    for (int i = 0; i < mag->count; i++) {
+        slab_deallocate(mag->objs[i]);
+    }
+    mag->count = 0;
+}
+
+// Return all objects in the magazines of a CPU to the slab layer.
+static void mag_flush_cpu(magazine_cpu_t *mc) {
+    mc->drain_gen = atomic_load_explicit(&mag_drain_gen, memory_order_relaxed);
+    SPIN_LOCK_LOCK(lock);
+    for (int class = 0; class < MAG_CLASSES; class++) {
+        mag_flush(mc->loaded[class]);
+        mag_flush(mc->previous[class]);
+    }
+    SPIN_LOCK_UNLOCK(lock);
+}
+
+// Get the magazines of this CPU for exclusive use until `mag_exit`.
+// Returns NULL if this CPU has no magazines.
+static magazine_cpu_t *mag_enter(bool *ie) {
+#ifdef BADGEROS_KERNEL
+    // Magazines are only used by their own CPU; disabling interrupts makes that exclusive.
+    *ie     = irq_disable();
+    int cpu = smp_cur_cpu();
+    if (cpu < 0 || cpu >= MAG_MAX_CPUS) {
+        irq_enable_if(*ie);
+        return NULL;
+    }
+    magazine_cpu_t *mc = &mag_cpus[cpu];
+#else
+    *ie     = false;
+    int cpu = sched_getcpu();
+    if (cpu < 0) {
+        cpu = 0;
+    }
+    magazine_cpu_t *mc = &mag_cpus[cpu % MAG_MAX_CPUS];
+    SPIN_LOCK_LOCK(mc->lock);
+#endif
+    if (mc->drain_gen != atomic_load_explicit(&mag_drain_gen, memory_order_relaxed)) {
+        // Another CPU ran out of memory; give back what this CPU has cached.
+        mag_flush_cpu(mc);
+    }
+    return mc;
+}
+
+// Stop using the magazines of this CPU.
+static void mag_exit(magazine_cpu_t *mc, bool ie) {
+#ifdef BADGEROS_KERNEL
+    (void)mc;
+    irq_enable_if(ie);
+#else
+    (void)ie;
+    SPIN_LOCK_UNLOCK(mc->lock);
+#endif
+}
+
+// Return all cached objects to the slab layer after an allocation failed.
+// This CPU's magazines and the depot are flushed immediately; other CPUs flush theirs on their next magazine operation.
+static void mag_drain() {
+    atomic_fetch_add_explicit(&mag_drain_gen, 1, memory_order_relaxed);
+    bool            ie;
+    magazine_cpu_t *mc = mag_enter(&ie);
+    if (mc) {
+        mag_exit(mc, ie);
+    }
+
+    SPIN_LOCK_LOCK(depot_lock);
+    SPIN_LOCK_LOCK(lock);
+    for (int class = 0; class < MAG_CLASSES; class++) {
+        magazine_depot_t *depot = &mag_depot[class];
+        while (depot->full_count) {
+            magazine_t *mag = depot->full[--depot->full_count];
+            mag_flush(mag);
+            depot->empty[depot->empty_count++] = mag;
+        }
+    }
+    SPIN_LOCK_UNLOCK(lock);
+    SPIN_LOCK_UNLOCK(depot_lock);
+}
+
+// Get the slab size class for an allocation of `size` bytes.
+static inline int mag_class(size_t size) {
+    if (size <= 32) {
+        return 0;
+    }
+    return 32 - __builtin_clz((uint32_t)size - 1) - 5;
+}
+
+// Get the number of objects a magazine of slab size class `class` caches.
+static inline int mag_capacity(int class) {
+    int cap = MAG_BYTES / (32 << class);
+    return cap < MAG_SIZE ? cap : MAG_SIZE;
+}
+
+// Allocate a slab object of `size` bytes from this CPU's magazines.
+// When both magazines are empty, the empty one is exchanged for a full one from the depot.
+// If the depot has no full magazines either, the loaded magazine is refilled from the slab layer in a batch.
+// Returns NULL if this CPU has no magazines or memory is exhausted.
+static void *mag_allocate(size_t size) {
+    bool            ie;
+    magazine_cpu_t *mc = mag_enter(&ie);
+    if (!mc) {
+        return NULL;
+    }
+    int         class = mag_class(size);
+    magazine_t *mag   = mc->loaded[class];
+
+    if (!mag->count && mc->previous[class]->count) {
+        // The spare magazine is full.
+        mc->loaded[class]   = mc->previous[class];
+        mc->previous[class] = mag;
+        mag                 = mc->loaded[class];
+
+    } else if (!mag->count) {
+        magazine_depot_t *depot = &mag_depot[class];
+        SPIN_LOCK_LOCK(depot_lock);
+        if (depot->full_count) {
+            depot->empty[depot->empty_count++] = mc->previous[class];
+            mc->previous[class]                = mag;
+            mc->loaded[class]                  = depot->full[--depot->full_count];
+            mag                                = mc->loaded[class];
+        }
+        SPIN_LOCK_UNLOCK(depot_lock);
+    }
+
+    if (!mag->count) {
+        SPIN_LOCK_LOCK(lock);
+        while (mag->count < mag_capacity(class) / 2) {
+            void *obj = slab_allocate(32 << class, SLAB_TYPE_SLAB, 0);
+            if (!obj) {
+                break;
+            }
+            mag->objs[mag->count++] = obj;
+        }
+        SPIN_LOCK_UNLOCK(lock);
+    }
+
+    void *ptr = mag->count ? mag->objs[--mag->count] : NULL;
+    mag_exit(mc, ie);
+    return ptr;
+}
+
+// Free a slab object into this CPU's magazines.
+// When both magazines are full, the full one is exchanged for an empty one from the depot.
+// If the depot has no empty magazines either, the oldest objects of the loaded magazine are flushed to the slab layer.
+// Returns false if this CPU has no magazines.
+static bool mag_free(void *ptr) {
+    bool            ie;
+    magazine_cpu_t *mc = mag_enter(&ie);
+    if (!mc) {
+        return false;
+    }
+    int         class = mag_class(slab_get_size(ptr));
+    magazine_t *mag   = mc->loaded[class];
+    int         cap   = mag_capacity(class);
+
+    if (mag->count >= cap && !mc->previous[class]->count) {
+        // The spare magazine is empty.
+        mc->loaded[class]   = mc->previous[class];
+        mc->previous[class] = mag;
+        mag                 = mc->loaded[class];
+
+    } else if (mag->count >= cap) {
+        magazine_depot_t *depot = &mag_depot[class];
+        SPIN_LOCK_LOCK(depot_lock);
+        if (depot->empty_count) {
+            depot->full[depot->full_count++] = mc->previous[class];
+            mc->previous[class]              = mag;
+            mc->loaded[class]                = depot->empty[--depot->empty_count];
+            mag                              = mc->loaded[class];
+        }
+        SPIN_LOCK_UNLOCK(depot_lock);
+    }
+
+    if (mag->count >= cap) {
+        int batch = cap / 2;
+        SPIN_LOCK_LOCK(lock);
+        for (int i = 0; i < batch; ++i) {
+            slab_deallocate(mag->objs[i]);
+        }
+        SPIN_LOCK_UNLOCK(lock);
+        __builtin_memmove(mag->objs, mag->objs + batch, (mag->count - batch) * sizeof(void *)); // NOLINT
+        mag->count -= batch;
+    }
+
+    mag->objs[mag->count++] = ptr;
+    mag_exit(mc, ie);
+    return true;
+}
+
+// Allocate `size` bytes, from this CPU's magazines if possible.
+// Shared by `malloc` and `calloc`; the compiler would turn `malloc` followed by `memset` back into `calloc`.
+static void *magazine_malloc(size_t size) {
+    if (size <= MAX_SLAB_SIZE) {
+        // Most allocations are served by this CPU's magazines without taking the shared lock.
+        void *ptr = mag_allocate(size);
+        if (ptr)
+            return ptr;
+    }
+
+    SPIN_LOCK_LOCK(lock);
+    void *ptr = _malloc(size);
+    SPIN_LOCK_UNLOCK(lock);
+
+    if (!ptr) {
+        // The memory may be cached in magazines.
+        mag_drain();
+        SPIN_LOCK_LOCK(lock);
+        ptr = _malloc(size);
+        SPIN_LOCK_UNLOCK(lock);
+    }
+
+    return ptr;
+}
+
 // NOLINTNEXTLINE
 void *__wrap_malloc(size_t size) {
 #ifdef PRELOAD
     if (!mem_initialized)
         kernel_heap_init();
 #endif
+    return magazine_malloc(size);
+}
+
+// Allocate `size` bytes aligned to `alignment`, which must be a power of two.
+static void *magazine_aligned_alloc(size_t alignment, size_t size) {
+    if (alignment <= MAX_SLAB_SIZE && size <= MAX_SLAB_SIZE) {
+        // Slab objects are naturally aligned to their size class.
+        return magazine_malloc(size > alignment ? size : alignment);
+    }
+
     SPIN_LOCK_LOCK(lock);
-    void *ptr = _malloc(size);
+    void *ptr = buddy_allocate_aligned(size ? size : 1, alignment, BLOCK_TYPE_PAGE, 0);
     SPIN_LOCK_UNLOCK(lock);
 
+    if (!ptr) {
+        // The memory may be cached in magazines.
+        mag_drain();
+        SPIN_LOCK_LOCK(lock);
+        ptr = buddy_allocate_aligned(size ? size : 1, alignment, BLOCK_TYPE_PAGE, 0);
+        SPIN_LOCK_UNLOCK(lock);
+    }
+
     return ptr;
 }
 
 // NOLINTNEXTLINE
 void *__wrap_aligned_alloc(size_t alignment, size_t size) {
-    (void)alignment;
 #ifdef PRELOAD
     if (!mem_initialized)
         kernel_heap_init();
 #endif
-    SPIN_LOCK_LOCK(lock);
-    void *ptr = _malloc(size);
-    SPIN_LOCK_UNLOCK(lock);
-
-    return ptr;
+    if (!alignment || (alignment & (alignment - 1))) {
+        return NULL;
+    }
+    return magazine_aligned_alloc(alignment, size);
 }
 
 // NOLINTNEXTLINE
 int __wrap_posix_memalign(void **memptr, size_t alignment, size_t size) {
-    (void)alignment;
 #ifdef PRELOAD
     if (!mem_initialized)
         kernel_heap_init();
 #endif
-    SPIN_LOCK_LOCK(lock);
-    void *ptr = _malloc(size);
-    SPIN_LOCK_UNLOCK(lock);
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    void *ptr = magazine_aligned_alloc(alignment, size);
+    if (!ptr) {
+        return ENOMEM;
+    }
 
     *memptr = ptr;
     return 0;
@@ -146,14 +465,35 @@ void *__wrap_calloc(size_t nmemb, size_t size) {
         kernel_heap_init();
 #endif
 
-    SPIN_LOCK_LOCK(lock);
-    void *ptr = _malloc(nmemb * size);
+    void *ptr = magazine_malloc(nmemb * size);
     if (ptr)
         __builtin_memset(ptr, 0, nmemb * size); // NOLINT
+    return ptr;
+}
+
+// Allocate whole pages for the object caches.
+void *kernel_heap_alloc_cache_pages(size_t size) {
+    SPIN_LOCK_LOCK(lock);
+    void *ptr = buddy_allocate(size, BLOCK_TYPE_CACHE, 0);
     SPIN_LOCK_UNLOCK(lock);
+
+    if (!ptr) {
+        // The memory may be cached in magazines.
+        mag_drain();
+        SPIN_LOCK_LOCK(lock);
+        ptr = buddy_allocate(size, BLOCK_TYPE_CACHE, 0);
+        SPIN_LOCK_UNLOCK(lock);
+    }
     return ptr;
 }
 
+// Free pages allocated by `kernel_heap_alloc_cache_pages`.
+void kernel_heap_free_cache_pages(void *ptr) {
+    SPIN_LOCK_LOCK(lock);
+    buddy_deallocate(ptr);
+    SPIN_LOCK_UNLOCK(lock);
+}
+
 // NOLINTNEXTLINE
 static void _free(void *ptr) {
     BADGEROS_MALLOC_MSG_DEBUG("free(" FMT_P ")", ptr);
@@ -176,6 +516,14 @@ void __wrap_free(void *ptr) {
     if (!mem_initialized)
         kernel_heap_init();
 #endif
+    if (!ptr) {
+        return;
+    }
+
+    // The page of a live allocation can't change type, so this is safe without the lock.
+    if (buddy_get_type(ALIGN_PAGE_DOWN(ptr)) == BLOCK_TYPE_SLAB && mag_free(ptr)) {
+        return;
+    }
 
     SPIN_LOCK_LOCK(lock);
     _free(ptr);
@@ -199,16 +547,14 @@ void *__wrap_realloc(void *ptr, size_t size) {
         return NULL;
     }
 
-    size_t old_size = 0;
-
-    SPIN_LOCK_LOCK(lock);
-    enum block_type type = buddy_get_type(ALIGN_PAGE_DOWN(ptr));
+    // The type and size of a live allocation don't change under us, so they are read without the lock.
+    size_t          old_size = 0;
+    enum block_type type     = buddy_get_type(ALIGN_PAGE_DOWN(ptr));
     switch (type) {
         case BLOCK_TYPE_PAGE: old_size = buddy_get_size(ptr); break;
         case BLOCK_TYPE_SLAB: old_size = slab_get_size(ptr); break;
         default:
             BADGEROS_MALLOC_MSG_ERROR("realloc(" FMT_P ") = Unknown pointer type: " FMT_I, ptr, type);
-            SPIN_LOCK_UNLOCK(lock);
             return ptr;
     }
 
@@ -216,27 +562,22 @@ void *__wrap_realloc(void *ptr, size_t size) {
 
     if (old_size >= size) {
         if (old_size > MAX_SLAB_SIZE && size > MAX_SLAB_SIZE) {
+            SPIN_LOCK_LOCK(lock);
             new_ptr = buddy_reallocate(ptr, size);
             SPIN_LOCK_UNLOCK(lock);
             return new_ptr;
         }
     }
 
-    new_ptr = _malloc(size);
+    new_ptr = __wrap_malloc(size);
     if (!new_ptr) {
         BADGEROS_MALLOC_MSG_WARN("realloc: failed to allocate memory, returning NULL");
-        SPIN_LOCK_UNLOCK(lock);
         return NULL;
     }
 
     size_t copy_size = old_size < size ? old_size : size;
     __builtin_memcpy(new_ptr, ptr, copy_size); // NOLINT
-    switch (type) {
-        case BLOCK_TYPE_PAGE: buddy_deallocate(ptr); break;
-        case BLOCK_TYPE_SLAB: slab_deallocate(ptr); break;
-        default: BADGEROS_MALLOC_MSG_ERROR("realloc(" FMT_P ") = Unknown pointer type", ptr);
-    }
-    SPIN_LOCK_UNLOCK(lock);
+    __wrap_free(ptr);
     return new_ptr;
 }
 
@@ -3,8 +3,9 @@
 /* Slab allocator for BadgerOS
  *
  * A Slab allocator works by dividing some memory region into slabs of identical size.
- * In our case, we support slabs of 32, 64, 128, and 256 bytes. Each page has its own
- * bitmap of free slots in the slab.
+ * In our case, we support slabs of 32, 64, 128, 256, 512, 1024 and 2048 bytes. Each slab
+ * has its own bitmap of free slots. Slabs of up to 256 bytes are a single page, larger
+ * ones span multiple pages so they still hold 15 slots; the header is in the first page.
  *
  * Furthermore the allocator keeps track of how full each slab is, and tries to use
  * the fullest slab first. The idea being that fuller slabs are less likely to be fully
@@ -12,6 +13,9 @@
  *
  * Once a page is fully empty, and there are no other empty pages of that size free, we
  * return the page to the global memory pool.
+ *
+ * The first slot of a page starts at a multiple of the slab size, so every allocation is
+ * naturally aligned to its size class; aligned allocations rely on this.
  */
 
 #ifndef BADGEROS_KERNEL
@@ -26,11 +30,19 @@
 #include <stdint.h>
 
 #define BITMAP_WORDS        4
-#define DATA_OFFSET         64
+#define SLAB_SIZES          7
 #define PAGE_ALLOC_BITS(x)  (((PAGE_SIZE - 32) - ((x)-1)) / (x))
 #define PAGE_ALLOC_BYTES(x) ((PAGE_ALLOC_BITS(x) + 7) / 8)
 
-enum slab_sizes_t { SLAB_SIZE_32 = 0, SLAB_SIZE_64 = 1, SLAB_SIZE_128 = 2, SLAB_SIZE_256 = 3 };
+enum slab_sizes_t {
+    SLAB_SIZE_32   = 0,
+    SLAB_SIZE_64   = 1,
+    SLAB_SIZE_128  = 2,
+    SLAB_SIZE_256  = 3,
+    SLAB_SIZE_512  = 4,
+    SLAB_SIZE_1024 = 5,
+    SLAB_SIZE_2048 = 6
+};
 enum slab_use_t {
     SLAB_USE_FULL         = 4,
     SLAB_USE_NEAR_FULL    = 3,
@@ -40,12 +52,19 @@ enum slab_use_t {
 };
 
 // Bytes per slab allocation
-static uint16_t slab_bytes[]        = {32, 64, 128, 256};
+static uint16_t slab_bytes[]        = {32, 64, 128, 256, 512, 1024, 2048};
+// Offset of the first slot in a slab; past the header and aligned to the slab size
+static uint16_t slab_offsets[]      = {64, 64, 128, 256, 512, 1024, 2048};
+// Pages per slab
+static uint16_t slab_pages[]        = {1, 1, 1, 1, 2, 4, 8};
 static uint16_t slab_tresholds[][4] = {
     {0, 32, 64, 126},
     {0, 16, 32, 63},
     {0, 8, 16, 31},
     {0, 4, 8, 15},
+    {0, 4, 8, 15},
+    {0, 4, 8, 15},
+    {0, 4, 8, 15},
 };
 
 // This needs to be correct otherwise finding an empty slab slot will not work
@@ -53,7 +72,10 @@ static uint32_t slab_empty[][4] = {
     {UINT32_MAX, UINT32_MAX, UINT32_MAX, 0x3FFFFFFF},
     {UINT32_MAX, 0x7FFFFFFF, 0, 0},
     {0x7FFFFFFF, 0, 0, 0},
-    {0x00007FFF, 0, 0, 0}
+    {0x00007FFF, 0, 0, 0},
+    {0x00007FFF, 0, 0, 0},
+    {0x00007FFF, 0, 0, 0},
+    {0x00007FFF, 0, 0, 0},
 };
 
 typedef struct slab_header_t {
@@ -74,7 +96,7 @@ typedef struct {
     slab_header_t slabs[5];
 } slab_lists_t;
 
-static slab_lists_t slabs[4];
+static slab_lists_t slabs[SLAB_SIZES];
 
 __attribute__((always_inline)) static inline uint32_t bitmap_clear_bit(uint32_t const word, uint8_t bit_index) {
     BADGEROS_MALLOC_ASSERT_ERROR(bit_index <= 31, "bit_index out of range " FMT_I " > 31", bit_index);
@@ -151,19 +173,15 @@ __attribute__((always_inline)) static inline slab_header_t *get_slab(enum slab_s
 
     BADGEROS_MALLOC_MSG_DEBUG("get_slab(" FMT_I ") allocation new page", size);
 
-    uint16_t pages      = 1;
-    void    *allocation = buddy_allocate(pages * PAGE_SIZE, BLOCK_TYPE_SLAB, 0);
+    slab = buddy_allocate(slab_pages[size] * PAGE_SIZE, BLOCK_TYPE_SLAB, 0);
 
-    if (!allocation) {
+    if (!slab) {
         BADGEROS_MALLOC_MSG_DEBUG("get_slab(" FMT_I ") allocation failed, returning NULL", size);
         return NULL;
     }
 
-    for (int i = 0; i < pages; ++i) {
-        slab = allocation + (i * PAGE_SIZE);
-        init_slab(slab, size);
-        list_push_back(&slabs[size].slabs[SLAB_USE_ALMOST_EMPTY], slab);
-    }
+    init_slab(slab, size);
+    list_push_back(&slabs[size].slabs[SLAB_USE_ALMOST_EMPTY], slab);
 
     BADGEROS_MALLOC_MSG_DEBUG("get_slab(" FMT_I ") returning " FMT_P, size, slab);
     return slab;
@@ -172,7 +190,7 @@ __attribute__((always_inline)) static inline slab_header_t *get_slab(enum slab_s
 // Initialize the kernel's slab lists
 void init_kernel_slabs() {
     BADGEROS_MALLOC_MSG_DEBUG("init_kernel_slabs()");
-    for (int i = 0; i < 4; ++i) {
+    for (int i = 0; i < SLAB_SIZES; ++i) {
         for (int k = 0; k < 5; ++k) {
             list_init(&slabs[i].slabs[k]);
         }
@@ -183,16 +201,12 @@ void *slab_allocate(size_t size, enum slab_type type, uint32_t flags) {
     (void)type;
     (void)flags;
     BADGEROS_MALLOC_MSG_DEBUG("slab_allocate(" FMT_ZI ")", size);
-    if (size > 256)
+    if (size > MAX_SLAB_SIZE)
         return NULL;
 
     uint8_t slab_type = SLAB_SIZE_32;
-    if (size > 128) {
-        slab_type = SLAB_SIZE_256;
-    } else if (size > 64) {
-        slab_type = SLAB_SIZE_128;
-    } else if (size > 32) {
-        slab_type = SLAB_SIZE_64;
+    while (slab_bytes[slab_type] < size) {
+        ++slab_type;
     }
 
     slab_header_t *page = NULL;
@@ -210,7 +224,7 @@ void *slab_allocate(size_t size, enum slab_type type, uint32_t flags) {
         page->bitmap[i]    = bitmap_clear_bit(page->bitmap[i], bit_index);
 
         size_t index  = (i * 32) + bit_index;
-        void  *retval = ((uint8_t *)page) + DATA_OFFSET + (index * slab_bytes[slab_type]);
+        void  *retval = ((uint8_t *)page) + slab_offsets[slab_type] + (index * slab_bytes[slab_type]);
         BADGEROS_MALLOC_MSG_DEBUG("slab_allocate(" FMT_ZI ") returning " FMT_P, size, retval);
         return retval;
     }
@@ -226,9 +240,9 @@ void slab_deallocate(void *ptr) {
         return;
     }
 
-    slab_header_t *header     = ALIGN_PAGE_DOWN(ptr);
+    slab_header_t *header     = buddy_get_start(ALIGN_PAGE_DOWN(ptr));
     size_t         offset     = (size_t)(ptr) - (size_t)(header);
-    offset                   -= DATA_OFFSET;
+    offset                   -= slab_offsets[header->size];
     uint32_t total_bit_index  = offset / slab_bytes[header->size];
     uint32_t word_index       = total_bit_index / 32;
     uint32_t bit_index        = total_bit_index % 32;
@@ -263,7 +277,7 @@ size_t slab_get_size(void *ptr) {
         return 0;
     }
 
-    slab_header_t *header = ALIGN_PAGE_DOWN(ptr);
+    slab_header_t *header = buddy_get_start(ALIGN_PAGE_DOWN(ptr));
     BADGEROS_MALLOC_MSG_DEBUG("slab_get_size(" FMT_P ") returning " FMT_I, ptr, slab_bytes[header->size]);
     return slab_bytes[header->size];
 }
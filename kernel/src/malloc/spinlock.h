@@ -7,6 +7,39 @@
 #include <stdatomic.h>
 #include <stdbool.h>
 
+#ifdef BADGEROS_KERNEL
+#include "config.h"
+#include "lockprof_private.h"
+#endif
+
+#if defined(BADGEROS_KERNEL) && CONFIG_LOCK_PROFILE
+#define SPIN_LOCK_LOCK(x)                                                                                              \
+    do {                                                                                                               \
+        timestamp_us_t __lockprof_start     = time_us();                                                               \
+        bool           __lockprof_contended = false;                                                                   \
+        int            __spin_backoff       = 1;                                                                       \
+        while (atomic_flag_test_and_set_explicit(&x, memory_order_acquire)) {                                          \
+            __lockprof_contended = true;                                                                               \
+            for (int __spin_i = 0; __spin_i < __spin_backoff; ++__spin_i) intr_pause();                                \
+            if (__spin_backoff < 16) /* limit backoff to 16 pauses */                                                  \
+                __spin_backoff <<= 1;                                                                                  \
+        }                                                                                                              \
+        lockprof_acquired(                                                                                             \
+            &x,                                                                                                        \
+            __builtin_return_address(0),                                                                               \
+            LOCKPROF_FLAG,                                                                                             \
+            __lockprof_contended,                                                                                      \
+            time_us() - __lockprof_start                                                                               \
+        );                                                                                                             \
+    } while (0)
+
+#define SPIN_LOCK_TRY_LOCK(x) !atomic_flag_test_and_set_explicit(&x, memory_order_acquire)
+#define SPIN_LOCK_UNLOCK(x)                                                                                            \
+    do {                                                                                                               \
+        lockprof_released(&x);                                                                                         \
+        atomic_flag_clear_explicit(&x, memory_order_release);                                                          \
+    } while (0)
+#else
 #define SPIN_LOCK_LOCK(x)                                                                                              \
     do {                                                                                                               \
         int __spin_backoff = 1;                                                                                        \
@@ -19,6 +52,7 @@
 
 #define SPIN_LOCK_TRY_LOCK(x) !atomic_flag_test_and_set_explicit(&x, memory_order_acquire)
 #define SPIN_LOCK_UNLOCK(x)   atomic_flag_clear_explicit(&x, memory_order_release)
+#endif
 #define DELAY(x)                                                                                                       \
     do {                                                                                                               \
         for (size_t i = 0; i < x; ++i) {                                                                               \
@@ -56,6 +56,18 @@
  * that at initialization time we don't immediately start off with blocks of differing
  * sizes.
  *
+ * To free a pointer we need to know which pool it came from. A page frame table
+ * maps every page that belongs to a pool to that pool's index. It has two levels:
+ * the root holds leaves that each cover 2^BUDDY_PFN_LEAF_BITS consecutive pages,
+ * found by hashing the upper bits of the page number, and every leaf holds one
+ * byte per page. Pools are mostly contiguous runs of pages, so they rarely share
+ * a root slot and the lookup takes a constant number of steps no matter how many
+ * pools there are. Leaves are stored in the metadata of the pool that first needs
+ * them. The root starts out with PFN_ROOT_SLOTS slots; a pool that would fill more
+ * than half of them stores a root twice as large (or larger) in its metadata and
+ * moves the existing leaves there. Lookups without the lock keep working during
+ * that because the old root and its leaves remain valid.
+ *
  */
 
 #include "static-buddy.h"
@@ -71,22 +83,111 @@
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+// The first page of a pool is aligned as far as that costs at most 1 / 2^BUDDY_ALIGN_SHIFT of its pages.
+#define BUDDY_ALIGN_SHIFT 6
+// Every leaf of the page frame table covers 2^BUDDY_PFN_LEAF_BITS pages.
+#define BUDDY_PFN_LEAF_BITS 10
+
+// Leaf of the page frame table.
+typedef struct {
+    // Page number of the first page covered, shifted right by BUDDY_PFN_LEAF_BITS.
+    size_t  key;
+    // Index + 1 of the pool each page belongs to, or 0 if it belongs to no pool.
+    uint8_t pools[1 << BUDDY_PFN_LEAF_BITS];
+} pfn_leaf_t;
+
+// Root of the page frame table; an open addressing hash table of leaves.
+typedef struct {
+    // Number of slots minus one; the number of slots is a power of two.
+    size_t       mask;
+    // Leaves, or NULL for empty slots.
+    pfn_leaf_t **slots;
+} pfn_root_t;
+
 uint8_t       memory_pool_num = 0;
 memory_pool_t memory_pools[MAX_MEMORY_POOLS];
 
+// Slots of the initial root of the page frame table.
+static pfn_leaf_t *pfn_root_initial_slots[PFN_ROOT_SLOTS];
+// Initial root of the page frame table.
+static pfn_root_t  pfn_root_initial = {PFN_ROOT_SLOTS - 1, pfn_root_initial_slots};
+// Current root of the page frame table; replaced by a larger one when it fills up.
+static pfn_root_t *pfn_root         = &pfn_root_initial;
+// Number of leaves in the page frame table.
+static size_t      pfn_leaves;
+
+// Find the slot in `root` of the page frame table leaf for `key`.
+// Returns the empty slot where it would go if there is no such leaf.
+__attribute__((always_inline)) static inline pfn_leaf_t **pfn_find_slot(pfn_root_t *root, size_t key) {
+    size_t i = key & root->mask;
+    while (root->slots[i] && root->slots[i]->key != key) {
+        i = (i + 1) & root->mask;
+    }
+    return &root->slots[i];
+}
+
 __attribute__((always_inline)) static inline memory_pool_t *ptr_to_pool(void *ptr) {
-    for (int i = 0; i < memory_pool_num; ++i) {
-        memory_pool_t *pool = &memory_pools[i];
-        if (ptr >= pool->pages_start && ptr < pool->pages_end) {
-            BADGEROS_MALLOC_MSG_DEBUG("ptr_to_pool(" FMT_P ") = " FMT_I, ptr, i);
-            return pool;
-        }
+    size_t      pfn  = (size_t)ptr / PAGE_SIZE;
+    pfn_root_t *root = __atomic_load_n(&pfn_root, __ATOMIC_ACQUIRE);
+    pfn_leaf_t *leaf = *pfn_find_slot(root, pfn >> BUDDY_PFN_LEAF_BITS);
+    uint8_t     pid  = leaf ? leaf->pools[pfn & ((1 << BUDDY_PFN_LEAF_BITS) - 1)] : 0;
+    if (pid) {
+        BADGEROS_MALLOC_MSG_DEBUG("ptr_to_pool(" FMT_P ") = " FMT_I, ptr, pid - 1);
+        return &memory_pools[pid - 1];
     }
 
     BADGEROS_MALLOC_MSG_DEBUG("ptr_to_pool() = NULL");
     return NULL;
 }
 
+// Count the page frame table leaves that are missing to cover `start` to `end`.
+static size_t pfn_count_missing(void *start, void *end) {
+    size_t missing = 0;
+    for (size_t key = (size_t)start / PAGE_SIZE >> BUDDY_PFN_LEAF_BITS;
+         key <= ((size_t)end - 1) / PAGE_SIZE >> BUDDY_PFN_LEAF_BITS;
+         ++key) {
+        missing += !*pfn_find_slot(pfn_root, key);
+    }
+    return missing;
+}
+
+// Map the pages from `start` to `end` to pool `pid` in the page frame table.
+// Missing leaves are taken from `spare`, which must have room for as many as `pfn_count_missing` returned.
+static void pfn_map(void *start, void *end, uint8_t pid, pfn_leaf_t *spare) {
+    for (size_t pfn = (size_t)start / PAGE_SIZE; pfn < (size_t)end / PAGE_SIZE; ++pfn) {
+        pfn_leaf_t **slot = pfn_find_slot(pfn_root, pfn >> BUDDY_PFN_LEAF_BITS);
+        if (!*slot) {
+            spare->key = pfn >> BUDDY_PFN_LEAF_BITS;
+            *slot      = spare++;
+            ++pfn_leaves;
+        }
+        (*slot)->pools[pfn & ((1 << BUDDY_PFN_LEAF_BITS) - 1)] = pid + 1;
+    }
+}
+
+// Get the number of root slots needed to hold `leaves` leaves in the page frame table.
+// Keeps at least half of the slots empty so lookups of pointers outside of all pools end quickly.
+static size_t pfn_root_size(size_t leaves) {
+    size_t size = pfn_root->mask + 1;
+    while (leaves * 2 > size) {
+        size *= 2;
+    }
+    return size;
+}
+
+// Move the page frame table to `root`, which has `size` zeroed slots after it.
+static void pfn_grow(pfn_root_t *root, size_t size) {
+    root->mask  = size - 1;
+    root->slots = (pfn_leaf_t **)(root + 1);
+    for (size_t i = 0; i <= pfn_root->mask; ++i) {
+        if (pfn_root->slots[i]) {
+            *pfn_find_slot(root, pfn_root->slots[i]->key) = pfn_root->slots[i];
+        }
+    }
+    // The old root stays valid for lookups that already started.
+    __atomic_store_n(&pfn_root, root, __ATOMIC_RELEASE);
+}
+
 __attribute__((always_inline)) static inline memory_pool_t *
     find_pool(uint8_t start_pool, uint8_t order, size_t alloc_size, uint32_t flags) {
     (void)flags;
@@ -270,14 +371,44 @@ void init_pool(void *mem_start, void *mem_end, uint32_t flags) {
 
     size_t metadata_block_size      = sizeof(buddy_block_t) * total_pages;
     size_t metadata_free_lists_size = sizeof(buddy_block_t) * (orders + 1);
+    size_t pfn_missing              = pfn_count_missing(mem_start, mem_end);
+    size_t metadata_pfn_size        = sizeof(pfn_leaf_t) * pfn_missing;
+    size_t pfn_size                 = pfn_root_size(pfn_leaves + pfn_missing);
+    size_t metadata_pfn_root_size   = 0;
+    if (pfn_size > pfn_root->mask + 1) {
+        // This pool holds the larger root the page frame table needs.
+        metadata_pfn_root_size = sizeof(pfn_root_t) + sizeof(pfn_leaf_t *) * pfn_size;
+    }
 
     memory_pools[memory_pool_num].free_lists = mem_start;
     memory_pools[memory_pool_num].blocks =
         ALIGN_UP(memory_pools[memory_pool_num].free_lists + metadata_free_lists_size, 8);
+    pfn_leaf_t *pfn_spare    = ALIGN_UP((void *)memory_pools[memory_pool_num].blocks + metadata_block_size, 8);
+    pfn_root_t *pfn_new_root = ALIGN_UP((void *)pfn_spare + metadata_pfn_size, 8);
 
-    void *pages_start = ALIGN_PAGE_UP((void *)memory_pools[memory_pool_num].blocks + metadata_block_size);
+    void *pages_start = ALIGN_PAGE_UP((void *)pfn_new_root + metadata_pfn_root_size);
     void *pages_end   = ALIGN_PAGE_DOWN(mem_end);
 
+    /* Alignment of the first page
+     *
+     * Blocks are naturally aligned relative to the first page, so aligning the first
+     * page aligns every block of up to that size too. This is what allows allocations
+     * with an alignment larger than a page. The alignment is skipped if it would leave
+     * less than half of the highest order usable.
+     */
+    size_t align = PAGE_SIZE;
+    while (align * 2 <= (total_pages >> BUDDY_ALIGN_SHIFT) * PAGE_SIZE) {
+        align *= 2;
+    }
+    void *aligned_start = ALIGN_UP(pages_start, align);
+    if (aligned_start < pages_end && ((size_t)pages_end - (size_t)aligned_start) / PAGE_SIZE >= ((size_t)1 << orders) / 2) {
+        pages_start = aligned_start;
+    }
+    uint8_t align_order = 0;
+    while (align_order < orders && !((size_t)pages_start & (PAGE_SIZE << align_order))) {
+        ++align_order;
+    }
+
     size_t   pages           = ((size_t)pages_end - (size_t)pages_start) / PAGE_SIZE;
     // NOLINTNEXTLINE
     uint32_t max_order_waste = (1 << orders) - pages;
@@ -292,9 +423,12 @@ void init_pool(void *mem_start, void *mem_end, uint32_t flags) {
     BADGEROS_MALLOC_MSG_INFO("Mem start: " FMT_P ", pages_start, " FMT_P, mem_start, pages_start);
     BADGEROS_MALLOC_MSG_INFO("Mem end: " FMT_P ", pages_end, " FMT_P, mem_end, pages_end);
     BADGEROS_MALLOC_MSG_INFO("Max orders: " FMT_I ", max_order_waste: " FMT_I, orders, max_order_waste);
+    BADGEROS_MALLOC_MSG_INFO("Alignment order: " FMT_I, align_order);
     BADGEROS_MALLOC_MSG_INFO("Waste starts at: " FMT_ZI, pages - max_order_waste);
     BADGEROS_MALLOC_MSG_INFO("Metadata block size: " FMT_ZI, metadata_block_size);
     BADGEROS_MALLOC_MSG_INFO("Metadata free lists size: " FMT_ZI, metadata_free_lists_size);
+    BADGEROS_MALLOC_MSG_INFO("Metadata page frame table size: " FMT_ZI, metadata_pfn_size);
+    BADGEROS_MALLOC_MSG_INFO("Metadata page frame table root size: " FMT_ZI, metadata_pfn_root_size);
 
     memory_pools[memory_pool_num].flags           = flags;
     memory_pools[memory_pool_num].start           = mem_start;
@@ -305,10 +439,17 @@ void init_pool(void *mem_start, void *mem_end, uint32_t flags) {
     memory_pools[memory_pool_num].free_pages      = pages;
     memory_pools[memory_pool_num].max_order       = orders;
     memory_pools[memory_pool_num].max_order_waste = max_order_waste;
+    memory_pools[memory_pool_num].align_order     = align_order;
 
     // Zero out all of our metadata
     __builtin_memset(memory_pools[memory_pool_num].start, 0, pages_start - mem_start); // NOLINT
 
+    // Map our pages to this pool
+    if (metadata_pfn_root_size) {
+        pfn_grow(pfn_new_root, pfn_size);
+    }
+    pfn_map(pages_start, pages_end, memory_pool_num, pfn_spare);
+
     // Initialize our free lists to be empty
     for (int i = 0; i <= orders; ++i) {
         list_init(&memory_pools[memory_pool_num].free_lists[i]);
@@ -414,14 +555,28 @@ __attribute__((always_inline)) static inline buddy_block_t *
  */
 
 void *buddy_allocate(size_t size, enum block_type type, uint32_t flags) {
+    return buddy_allocate_aligned(size, PAGE_SIZE, type, flags);
+}
+
+/* Aligned allocation
+ *
+ * Every block is aligned to its own size relative to the first page of its pool,
+ * so an alignment larger than a page is met by allocating a block of at least the
+ * alignment's order from a pool whose first page is aligned at least as much.
+ *
+ * The alignment must be a power of two; alignments up to a page are always met.
+ */
+
+void *buddy_allocate_aligned(size_t size, size_t align, enum block_type type, uint32_t flags) {
     (void)flags;
-    BADGEROS_MALLOC_MSG_DEBUG("buddy_allocate(" FMT_ZI ")", size);
+    BADGEROS_MALLOC_MSG_DEBUG("buddy_allocate_aligned(" FMT_ZI ", " FMT_ZI ")", size, align);
     if (!size) {
         return NULL;
     }
 
     size_t         pages                     = (size + (PAGE_SIZE - 1)) / PAGE_SIZE;
-    uint8_t        allocation_order          = get_order(pages);
+    uint8_t        align_order               = align > PAGE_SIZE ? get_order(align / PAGE_SIZE) : 0;
+    uint8_t        allocation_order          = MAX(get_order(pages), align_order);
     uint8_t        original_allocation_order = allocation_order;
     buddy_block_t *block                     = NULL;
     memory_pool_t *pool                      = NULL;
@@ -439,6 +594,13 @@ void *buddy_allocate(size_t size, enum block_type type, uint32_t flags) {
             break;
         }
 
+        if (pool->align_order < align_order) {
+            // Blocks of this pool aren't aligned far enough.
+            i    = pool - memory_pools;
+            pool = NULL;
+            continue;
+        }
+
         if (allocation_order == pool->max_order) {
             // NOLINTNEXTLINE
             if (size > (1 << allocation_order) - pool->max_order_waste) {
@@ -472,6 +634,14 @@ void *buddy_allocate(size_t size, enum block_type type, uint32_t flags) {
     block->type       = type;
     void *retval      = block_to_address(pool, block);
 
+    if (type == BLOCK_TYPE_SLAB || type == BLOCK_TYPE_CACHE) {
+        // Every page of a slab points to the first, so objects in later pages can find the slab header.
+        for (size_t i = 0; i < pages; ++i) {
+            block[i].type = type;
+            block[i].next = block;
+        }
+    }
+
     BADGEROS_MALLOC_MSG_DEBUG("buddy_allocate(" FMT_ZI ") returning " FMT_P, size, retval);
     return retval;
 }
@@ -520,6 +690,16 @@ void buddy_deallocate(void *ptr) {
         return;
     }
 
+    if (block->type == BLOCK_TYPE_SLAB || block->type == BLOCK_TYPE_CACHE) {
+        size_t index = block_to_index(pool, block);
+        for (size_t i = 1; i < ((size_t)1 << block->order) && index + i < pool->pages; ++i) {
+            if (block[i].type != block->type || block[i].next != block) {
+                break;
+            }
+            block[i].type = BLOCK_TYPE_FREE;
+        }
+    }
+
     pool->free_pages += (1 << block->order);
     block->type       = BLOCK_TYPE_FREE;
     free_block(pool, block);
@@ -585,3 +765,27 @@ size_t buddy_get_size(void *ptr) {
     BADGEROS_MALLOC_MSG_DEBUG("buddy_get_size(" FMT_P ") returning " FMT_I, ptr, (1 << block->order) * PAGE_SIZE);
     return (1 << block->order) * PAGE_SIZE;
 }
+
+/* Start of a slab
+ *
+ * Slabs, including those of object caches, can span multiple pages, of which only
+ * the first holds the slab header.
+ * Every page of a slab points to the first one, so this finds the start of the
+ * slab from any page in it. For other blocks the page itself is returned.
+ */
+
+void *buddy_get_start(void *ptr) {
+    BADGEROS_MALLOC_MSG_DEBUG("buddy_get_start(" FMT_P ")", ptr);
+
+    memory_pool_t *pool  = NULL;
+    buddy_block_t *block = buddy_get_block(ptr, &pool);
+
+    if (!block) {
+        return NULL;
+    }
+
+    if (block->type == BLOCK_TYPE_SLAB || block->type == BLOCK_TYPE_CACHE) {
+        block = block->next;
+    }
+    return block_to_address(pool, block);
+}
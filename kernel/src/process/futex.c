@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: MIT
+
+#include "errno.h"
+#include "malloc.h"
+#include "memprotect.h"
+#include "mutex.h"
+#include "process/internal.h"
+#include "process/types.h"
+#include "syscall_util.h"
+#include "waitqueue.h"
+#if MEMMAP_VMEM
+#include "cpu/mmu.h"
+#endif
+
+// Log2 of the number of futex hash buckets.
+#define FUTEX_BUCKET_BITS 6
+// Number of futex hash buckets.
+#define FUTEX_BUCKETS     (1 << FUTEX_BUCKET_BITS)
+
+// Wait queue for a single futex address.
+typedef struct {
+    // Bucket list link.
+    dlist_node_t node;
+    // Physical address of the futex word.
+    size_t       paddr;
+    // Number of threads waiting or about to wait on this futex.
+    int          refcount;
+    // Threads waiting on this futex.
+    waitqueue_t  queue;
+} futex_t;
+
+// Futex hash bucket.
+typedef struct {
+    // Mutex guarding the futex list.
+    mutex_t mtx;
+    // Futexes in this bucket that have waiters.
+    dlist_t list;
+} futex_bucket_t;
+
+// Futex hash table.
+static futex_bucket_t futex_table[FUTEX_BUCKETS];
+
+
+
+// Get the hash bucket for a physical address.
+static futex_bucket_t *futex_bucket(size_t paddr) {
+    size_t hash = (paddr >> 2) * (size_t)0x9E3779B97F4A7C15ULL;
+    return &futex_table[hash >> (sizeof(size_t) * 8 - FUTEX_BUCKET_BITS)];
+}
+
+// Find the futex for a physical address in a bucket.
+// The bucket mutex must be held.
+static futex_t *futex_find(futex_bucket_t *bucket, size_t paddr) {
+    futex_t *futex = (futex_t *)bucket->list.head;
+    while (futex && futex->paddr != paddr) {
+        futex = (futex_t *)futex->node.next;
+    }
+    return futex;
+}
+
+// Translate a futex address from the current process into a physical address.
+// Returns 0 if the address is invalid.
+static size_t futex_paddr(int *addr) {
+    if ((size_t)addr & (sizeof(int) - 1)) {
+        return 0;
+    }
+    if (!sysutil_memperm(addr, sizeof(int), MEMPROTECT_FLAG_RW)) {
+        return 0;
+    }
+#if MEMMAP_VMEM
+    return memprotect_virt2phys(&proc_current()->memmap.mpu_ctx, (size_t)addr).paddr;
+#else
+    return (size_t)addr;
+#endif
+}
+
+// Wake the futex waiters belonging to an exiting process so they can return.
+void proc_futex_wake_all(process_t *process) {
+    for (size_t i = 0; i < FUTEX_BUCKETS; i++) {
+        mutex_acquire(NULL, &futex_table[i].mtx, TIMESTAMP_US_MAX);
+        futex_t *futex = (futex_t *)futex_table[i].list.head;
+        while (futex) {
+            waitqueue_notify_process(&futex->queue, process);
+            futex = (futex_t *)futex->node.next;
+        }
+        mutex_release(NULL, &futex_table[i].mtx);
+    }
+}
+
+
+
+// Block until `*addr` is changed by another thread and `futex_wake` is called on it.
+NOASAN int syscall_futex_wait(int *addr, int expected, int64_t timeout) {
+    size_t paddr = futex_paddr(addr);
+    if (!paddr) {
+        return -EFAULT;
+    }
+    futex_bucket_t *bucket = futex_bucket(paddr);
+
+    // Look up or create the futex.
+    mutex_acquire(NULL, &bucket->mtx, TIMESTAMP_US_MAX);
+    futex_t *futex = futex_find(bucket, paddr);
+    if (!futex) {
+        futex = malloc(sizeof(futex_t));
+        if (!futex) {
+            mutex_release(NULL, &bucket->mtx);
+            return -ENOMEM;
+        }
+        *futex = (futex_t){
+            .node  = DLIST_NODE_EMPTY,
+            .paddr = paddr,
+            .queue = WAITQUEUE_T_INIT,
+        };
+        dlist_append(&bucket->list, &futex->node);
+    }
+    futex->refcount++;
+    // Sampled before reading the futex word so a wake after changing it is not missed.
+    int seq = waitqueue_seq(&futex->queue);
+    mutex_release(NULL, &bucket->mtx);
+
+    // Check the futex word.
+#if MEMMAP_VMEM
+    mmu_enable_sum();
+#endif
+    int value = atomic_load((_Atomic int *)addr);
+#if MEMMAP_VMEM
+    mmu_disable_sum();
+#endif
+    int res = 0;
+    if (value != expected) {
+        res = -EAGAIN;
+    } else if (atomic_load(&proc_current()->flags) & PROC_EXITING) {
+        res = -EINTR;
+    } else if (!waitqueue_block(&futex->queue, seq, timeout)) {
+        res = -ETIMEDOUT;
+    }
+
+    // Release the futex.
+    mutex_acquire(NULL, &bucket->mtx, TIMESTAMP_US_MAX);
+    if (--futex->refcount == 0) {
+        dlist_remove(&bucket->list, &futex->node);
+        waitqueue_destroy(&futex->queue);
+        free(futex);
+    }
+    mutex_release(NULL, &bucket->mtx);
+
+    return res;
+}
+
+// Wake up to `count` threads blocked in `futex_wait` on `addr`.
+int syscall_futex_wake(int *addr, int count) {
+    size_t paddr = futex_paddr(addr);
+    if (!paddr) {
+        return -EFAULT;
+    }
+    futex_bucket_t *bucket = futex_bucket(paddr);
+
+    int woken = 0;
+    mutex_acquire(NULL, &bucket->mtx, TIMESTAMP_US_MAX);
+    futex_t *futex = futex_find(bucket, paddr);
+    if (futex) {
+        if (count >= futex->refcount) {
+            woken = waitqueue_notify_all(&futex->queue);
+        } else {
+            while (woken < count && waitqueue_notify(&futex->queue)) {
+                woken++;
+            }
+        }
+    }
+    mutex_release(NULL, &bucket->mtx);
+
+    return woken;
+}
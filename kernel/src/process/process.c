@@ -10,6 +10,7 @@
 #include "housekeeping.h"
 #include "isr_ctx.h"
 #include "kbelf.h"
+#include "kmem_cache.h"
 #include "log.h"
 #include "malloc.h"
 #include "memprotect.h"
@@ -33,18 +34,22 @@
 
 
 // Globally unique PID number counter.
-static pid_t       pid_counter = 1;
+static pid_t        pid_counter      = 1;
 // Global process lifetime mutex.
-mutex_t            proc_mtx    = MUTEX_T_INIT_SHARED;
+mutex_t             proc_mtx         = MUTEX_T_INIT_SHARED;
 // Number of processes.
-static size_t      procs_len   = 0;
+static size_t       procs_len        = 0;
 // Capacity for processes.
-static size_t      procs_cap   = 0;
+static size_t       procs_cap        = 0;
 // Process array.
-static process_t **procs       = NULL;
-extern atomic_int  kernel_shutdown_mode;
+static process_t  **procs            = NULL;
+// Cache of process handles.
+static kmem_cache_t process_cache    = KMEM_CACHE_T_INIT("process_t", process_t, NULL, NULL);
+// Cache of pending signals.
+kmem_cache_t        sigpending_cache = KMEM_CACHE_T_INIT("sigpending_t", sigpending_t, NULL, NULL);
+extern atomic_int   kernel_shutdown_mode;
 // Allow process 1 to die without kernel panic.
-static bool        allow_proc1_death() {
+static bool         allow_proc1_death() {
     // While the kernel is shutting down and init is the only process left.
     return kernel_shutdown_mode && procs_len == 1;
 }
@@ -110,6 +115,7 @@ static void clean_up_from_housekeeping(int taskno, void *arg) {
     } else {
         // Signal parent process.
         atomic_fetch_or(&proc->flags, PROC_STATECHG);
+        waitqueue_notify_all(&proc->parent->waitpid_queue);
         proc_raise_signal_raw(NULL, proc->parent, SIGCHLD);
         mutex_release_shared(NULL, &proc_mtx);
     }
@@ -125,6 +131,10 @@ void proc_exit_self(int code) {
     process->state_code = code;
     mutex_release(NULL, &process->mtx);
 
+    // Interrupt other threads of this process waiting for children or futexes.
+    waitqueue_notify_all(&process->waitpid_queue);
+    proc_futex_wake_all(process);
+
     // Add deleting runtime to the housekeeping list.
     assert_always(hk_add_once(0, clean_up_from_housekeeping, (void *)(long)process->pid) != -1);
 
@@ -152,7 +162,7 @@ process_t *proc_create_raw(badge_err_t *ec, pid_t parentpid, char const *binary,
     }
 
     // Allocate a process entry.
-    process_t *handle = malloc(sizeof(process_t));
+    process_t *handle = kmem_cache_alloc(&process_cache);
     if (!handle) {
         mutex_release(NULL, &proc_mtx);
         badge_err_set(ec, ELOC_PROCESS, ECAUSE_NOMEM);
@@ -180,10 +190,11 @@ process_t *proc_create_raw(badge_err_t *ec, pid_t parentpid, char const *binary,
                 .regions     = NULL,
 #endif
             },
-        .mtx        = MUTEX_T_INIT_SHARED,
-        .flags      = PROC_PRESTART,
-        .sigpending = DLIST_EMPTY,
-        .children   = DLIST_EMPTY,
+        .mtx           = MUTEX_T_INIT_SHARED,
+        .flags         = PROC_PRESTART,
+        .sigpending    = DLIST_EMPTY,
+        .children      = DLIST_EMPTY,
+        .waitpid_queue = WAITQUEUE_T_INIT,
     };
 
     // Set default signal handlers.
@@ -193,7 +204,7 @@ process_t *proc_create_raw(badge_err_t *ec, pid_t parentpid, char const *binary,
 
     // Install arguments.
     if (!proc_setargs_raw_unsafe(ec, handle, argc, argv)) {
-        free(handle);
+        kmem_cache_free(&process_cache, handle);
         mutex_release(NULL, &proc_mtx);
         badge_err_set(ec, ELOC_PROCESS, ECAUSE_NOMEM);
         return NULL;
@@ -203,7 +214,7 @@ process_t *proc_create_raw(badge_err_t *ec, pid_t parentpid, char const *binary,
     array_binsearch_t res = array_binsearch(procs, sizeof(process_t *), procs_len, &handle, proc_sort_pid_cmp);
     if (!array_lencap_insert(&procs, sizeof(process_t *), &procs_len, &procs_cap, NULL, res.index)) {
         free(handle->argv);
-        free(handle);
+        kmem_cache_free(&process_cache, handle);
         mutex_release(NULL, &proc_mtx);
         badge_err_set(ec, ELOC_PROCESS, ECAUSE_NOMEM);
         return NULL;
@@ -447,6 +458,10 @@ static void proc_raise_sigkill_raw(process_t *process) {
     process->state_code = W_SIGNALLED(SIGKILL);
     mutex_release(NULL, &process->mtx);
 
+    // Interrupt threads of this process waiting for children or futexes.
+    waitqueue_notify_all(&process->waitpid_queue);
+    proc_futex_wake_all(process);
+
     // Add deleting runtime to the housekeeping list.
     assert_always(hk_add_once(0, clean_up_from_housekeeping, (void *)(long)process->pid) != -1);
 }
@@ -459,7 +474,7 @@ void proc_raise_signal_raw(badge_err_t *ec, process_t *process, int signum) {
         return;
     }
     mutex_acquire(NULL, &process->mtx, TIMESTAMP_US_MAX);
-    sigpending_t *node = malloc(sizeof(sigpending_t));
+    sigpending_t *node = kmem_cache_alloc(&sigpending_cache);
     if (!node) {
         badge_err_set(ec, ELOC_PROCESS, ECAUSE_NOMEM);
     } else {
@@ -589,8 +604,11 @@ static bool proc_delete_impl(pid_t pid, bool only_prestart) {
 
     // Release kernel memory allocated to process.
     memprotect_destroy(&handle->memmap.mpu_ctx);
+    while (handle->sigpending.len) {
+        kmem_cache_free(&sigpending_cache, dlist_pop_front(&handle->sigpending));
+    }
     free(handle->argv);
-    free(handle);
+    kmem_cache_free(&process_cache, handle);
     array_lencap_remove(&procs, sizeof(process_t *), &procs_len, &procs_cap, NULL, res.index);
     mutex_release(NULL, &proc_mtx);
 
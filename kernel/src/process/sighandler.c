@@ -88,8 +88,9 @@ void proc_signal_handler() {
         // Pop the first pending signal and run its handler.
         sigpending_t *node = (sigpending_t *)dlist_pop_front(&proc->sigpending);
         mutex_release(NULL, &proc->mtx);
-        run_sighandler(node->signum, 0);
-        free(node);
+        int signum = node->signum;
+        kmem_cache_free(&sigpending_cache, node);
+        run_sighandler(signum, 0);
     } else {
         mutex_release(NULL, &proc->mtx);
     }
@@ -160,7 +160,9 @@ NOASAN int syscall_proc_waitpid(int pid, int *wstatus, int options) {
     // Check memory ownership.
     sysutil_memassert_rw(wstatus, sizeof(int));
 
-    while (!(options & WNOHANG)) {
+    while (1) {
+        // Sampled before checking the children so no state change is missed.
+        int seq = waitqueue_seq(&proc->waitpid_queue);
         mutex_acquire_shared(NULL, &proc->mtx, TIMESTAMP_US_MAX);
         process_t *node     = (process_t *)proc->children.head;
         bool       eligible = false;
@@ -201,11 +203,17 @@ NOASAN int syscall_proc_waitpid(int pid, int *wstatus, int options) {
             // No children with matching PIDs exist.
             return -ECHILD;
         }
-        thread_yield();
+        if (options & WNOHANG) {
+            // Nothing found in non-blocking wait.
+            return 0;
+        }
+        if (atomic_load(&proc->flags) & PROC_EXITING) {
+            // This process is exiting; don't wait for children any longer.
+            return -EINTR;
+        }
+        // Sleep until a child changes state.
+        waitqueue_block(&proc->waitpid_queue, seq, -1);
     }
-
-    // Nothing found in non-blocking wait.
-    return 0;
 }
 
 
@@ -3,53 +3,178 @@
 
 #include "scheduler/scheduler.h"
 
-#include "arrays.h"
 #include "assertions.h"
 #include "badge_strings.h"
 #include "config.h"
 #include "cpu/isr.h"
+#include "errno.h"
 #include "housekeeping.h"
 #include "interrupt.h"
 #include "isr_ctx.h"
+#include "kmem_cache.h"
 #include "malloc.h"
 #include "process/sighandler.h"
 #include "scheduler/cpu.h"
 #include "scheduler/isr.h"
+#include "scheduler/trace.h"
 #include "scheduler/types.h"
 #include "smp.h"
+#include "syscall_util.h"
+#include "usercopy.h"
 
 
 
 // Number of CPUs with running schedulers.
 static atomic_int        running_sched_count;
-// Number of CPUs ready to perform a load balance.
-static atomic_int        loadbalance_ready_count;
 // CPU-local scheduler structs.
 static sched_cpulocal_t *cpu_ctx;
 // Threads list mutex.
 static mutex_t           threads_mtx = MUTEX_T_INIT_SHARED_ISR;
 // Number of threads that exist.
 static size_t            threads_len;
-// Capacity for thread list.
+// Number of slots in `threads` that hold a thread or a tombstone.
+static size_t            threads_used;
+// Capacity of `threads`; zero or a power of two.
 static size_t            threads_cap;
-// Array of all threads that exist.
+// Open-addressed hash table of all threads that exist, indexed by TID.
 static sched_thread_t  **threads;
 // Thread ID counter.
 static atomic_int        tid_counter = 1;
-// Unused thread pool mutex.
+// Dead threads list mutex.
 static mutex_t           unused_mtx  = MUTEX_T_INIT_ISR;
-// Pool of unused thread handles.
+// Threads that have exited and are waiting to be reaped by housekeeping.
 static dlist_t           dead_threads;
+// Whether idle CPUs halt until the next timer task instead of polling.
+static bool              idle_tickless;
 
 
 
+// Get the runqueue priority level for a thread, or -1 for threads in the EDF class.
+static inline int runqueue_level(sched_thread_t *thread) {
+    if (thread->edf.period) {
+        return -1;
+    }
+    int priority = thread_effective_prio(thread);
+    if (priority < 0) {
+        return 0;
+    } else if (priority >= SCHED_PRIO_LEVELS) {
+        return SCHED_PRIO_LEVELS - 1;
+    }
+    return priority;
+}
+
+// Get the runqueue list for a priority level, or the EDF queue for level -1.
+static inline dlist_t *runqueue_list(sched_cpulocal_t *info, int level) {
+    return level < 0 ? &info->edf_queue : &info->queue[level];
+}
+
+// Take a CPU's runqueue spinlock.
+// Interrupts must be disabled.
+static inline void runqueue_lock(sched_cpulocal_t *info) {
+    while (atomic_flag_test_and_set_explicit(&info->queue_lock, memory_order_acquire)) {
+        isr_pause();
+    }
+}
+
+// Release a CPU's runqueue spinlock.
+static inline void runqueue_unlock(sched_cpulocal_t *info) {
+    atomic_flag_clear_explicit(&info->queue_lock, memory_order_release);
+}
+
+// Add a thread to the back of its priority level in the runqueue.
+// The runqueue spinlock must be held.
+static void runqueue_append(sched_cpulocal_t *info, sched_thread_t *thread) {
+    int level          = runqueue_level(thread);
+    thread->queue_prio = level;
+    thread->queue_cpu  = info;
+    dlist_append(runqueue_list(info, level), &thread->node);
+    if (level >= 0) {
+        info->queue_bitmap |= 1u << level;
+    }
+    atomic_fetch_add_explicit(&info->queue_len, 1, memory_order_relaxed);
+}
+
+// Add a thread to the front of its priority level in the runqueue.
+// The runqueue spinlock must be held.
+static void runqueue_prepend(sched_cpulocal_t *info, sched_thread_t *thread) {
+    int level          = runqueue_level(thread);
+    thread->queue_prio = level;
+    thread->queue_cpu  = info;
+    dlist_prepend(runqueue_list(info, level), &thread->node);
+    if (level >= 0) {
+        info->queue_bitmap |= 1u << level;
+    }
+    atomic_fetch_add_explicit(&info->queue_len, 1, memory_order_relaxed);
+}
+
+// Remove a thread from the runqueue.
+// The runqueue spinlock must be held.
+static void runqueue_remove(sched_cpulocal_t *info, sched_thread_t *thread) {
+    int level         = thread->queue_prio;
+    thread->queue_cpu = NULL;
+    dlist_remove(runqueue_list(info, level), &thread->node);
+    if (level >= 0 && !info->queue[level].len) {
+        info->queue_bitmap &= ~(1u << level);
+    }
+    atomic_fetch_sub_explicit(&info->queue_len, 1, memory_order_relaxed);
+}
+
+// Pop the first thread from the highest non-empty priority level in the runqueue.
+// The runqueue spinlock must be held.
+// Returns NULL if all priority levels are empty; EDF threads are taken by `runqueue_pop_edf` instead.
+static sched_thread_t *runqueue_pop(sched_cpulocal_t *info) {
+    if (!info->queue_bitmap) {
+        return NULL;
+    }
+    int             level  = 31 - __builtin_clz(info->queue_bitmap);
+    sched_thread_t *thread = (void *)dlist_pop_front(&info->queue[level]);
+    thread->queue_cpu      = NULL;
+    if (!info->queue[level].len) {
+        info->queue_bitmap &= ~(1u << level);
+    }
+    atomic_fetch_sub_explicit(&info->queue_len, 1, memory_order_relaxed);
+    return thread;
+}
+
+// Pop the EDF thread with the earliest deadline that has budget left in its current period.
+// Replenishes the budget of threads whose period has ended and updates `info->edf_replenish`.
+// The runqueue spinlock must be held.
+// Returns NULL if no EDF thread may run right now.
+static sched_thread_t *runqueue_pop_edf(sched_cpulocal_t *info, timestamp_us_t now) {
+    sched_thread_t *best = NULL;
+    info->edf_replenish  = TIMESTAMP_US_MAX;
+    for (dlist_node_t *node = info->edf_queue.head; node; node = node->next) {
+        sched_thread_t *thread = (sched_thread_t *)node;
+        sched_edf_t    *edf    = &thread->edf;
+        if (now >= edf->deadline) {
+            // Start the next period; periods that were missed entirely are skipped instead of run late.
+            edf->deadline += ((now - edf->deadline) / edf->period + 1) * edf->period;
+            edf->used      = 0;
+        }
+        if (edf->used >= edf->runtime) {
+            // Budget overrun; throttled until the next period.
+            if (edf->deadline < info->edf_replenish) {
+                info->edf_replenish = edf->deadline;
+            }
+        } else if (!best || edf->deadline < best->edf.deadline) {
+            best = thread;
+        }
+    }
+    if (best) {
+        runqueue_remove(info, best);
+    }
+    return best;
+}
+
 // Remove the current thread from the runqueue from this CPU.
 // Interrupts must be disabled.
 sched_thread_t *thread_dequeue_self() {
     isr_ctx_t        *kctx = isr_ctx_get();
     sched_cpulocal_t *info = kctx->cpulocal->sched;
     sched_thread_t   *self = kctx->thread;
-    dlist_remove(&info->queue, &self->node);
+    runqueue_lock(info);
+    runqueue_remove(info, self);
+    runqueue_unlock(info);
     return self;
 }
 
@@ -68,26 +193,187 @@ static void set_switch(sched_cpulocal_t *info, sched_thread_t *thread) {
     isr_ctx_t *next = (tflags & THREAD_PRIVILEGED) ? &thread->kernel_isr_ctx : &thread->user_isr_ctx;
     next->cpulocal  = isr_ctx_get()->cpulocal;
     isr_ctx_switch_set(next);
+    thread->last_cpu = info - cpu_ctx;
+    SCHED_TRACE(SCHEDTRACE_SWITCH, thread->id, thread_effective_prio(thread));
+
+    // Account wake-to-run latency.
+    timestamp_us_t now = time_us();
+    if (thread->wake_time) {
+        timestamp_us_t latency = now - thread->wake_time;
+        thread->wake_time      = 0;
+        runqueue_lock(info);
+        info->wakestat.count++;
+        info->wakestat.total += latency;
+        if (latency > info->wakestat.max) {
+            info->wakestat.max = latency;
+        }
+        runqueue_unlock(info);
+    }
 
     // Set preemption timer.
-    timestamp_us_t now     = time_us();
-    timestamp_us_t timeout = now + SCHED_MIN_US + SCHED_INC_US * thread->priority;
-    if (timeout > info->load_measure_time) {
+    timestamp_us_t timeout = now + SCHED_MIN_US + SCHED_INC_US * thread_effective_prio(thread);
+    if (thread->edf.period) {
+        // EDF threads run until their budget for this period runs out.
+        timeout = now + thread->edf.runtime - thread->edf.used;
+    }
+    if (thread == &info->idle_thread && idle_tickless) {
+        // Tickless idle; only timer tasks and interrupts wake this CPU up.
+        timeout = TIMESTAMP_US_MAX;
+    } else if (timeout > info->load_measure_time) {
         timeout = info->load_measure_time;
     }
+    if (timeout > info->edf_replenish) {
+        // Reschedule when a throttled EDF thread gets its budget back.
+        timeout = info->edf_replenish;
+    }
     info->last_preempt = now;
     time_set_next_task_switch(timeout);
 }
 
+// Whether the scheduler is running on a CPU and not about to exit.
+static bool sw_cpu_is_running(int cpu) {
+    int flags = atomic_load(&cpu_ctx[cpu].flags);
+    return (flags & SCHED_RUNNING) && !(flags & SCHED_EXITING);
+}
+
+// Whether the scheduler has exited on a CPU; threads handed off to it would never run.
+static bool sw_cpu_has_exited(int cpu) {
+    return atomic_load(&cpu_ctx[cpu].flags) & SCHED_EXITED;
+}
+
+// Get the CPU to hand `thread` off to instead of `cpu`.
+// Returns `cpu` if the thread is allowed to run there, otherwise the next CPU it is allowed on,
+// preferring CPUs on which the scheduler is running and never returning CPUs on which it has exited.
+// If the scheduler has exited on all CPUs the thread is allowed on, returns `cpu` or another CPU it runs on.
+static int sw_affine_cpu(sched_thread_t *thread, int cpu) {
+    sched_cpumask_t mask = thread->affinity;
+    if (SCHED_CPUMASK_HAS(mask, cpu) && !sw_cpu_has_exited(cpu)) {
+        return cpu;
+    }
+    int fallback = -1;
+    int any      = -1;
+    for (int i = 1; i < smp_count; i++) {
+        int other = (cpu + i) % smp_count;
+        if (sw_cpu_has_exited(other)) {
+            continue;
+        } else if (!SCHED_CPUMASK_HAS(mask, other)) {
+            if (any < 0 && sw_cpu_is_running(other)) {
+                any = other;
+            }
+        } else if (sw_cpu_is_running(other)) {
+            return other;
+        } else if (fallback < 0) {
+            fallback = other;
+        }
+    }
+    if (fallback >= 0) {
+        return fallback;
+    }
+    // None of the CPUs this thread is allowed on remain; run it elsewhere rather than lose it.
+    return sw_cpu_is_running(cpu) || any < 0 ? cpu : any;
+}
+
+// Get the priority with which a thread preempts others; EDF threads preempt all threads in the normal class.
+static inline int sw_preempt_prio(sched_thread_t *thread) {
+    return thread->edf.period ? __INT_MAX__ : thread_effective_prio(thread);
+}
+
+// Whether a thread ran recently enough that its cache on the CPU it last ran on is likely still warm.
+static inline bool sw_cache_hot(sched_thread_t *thread, timestamp_us_t now) {
+    return now - thread->last_ran < SCHED_CACHE_HOT_US;
+}
+
+// Get the CPU to wake `thread` up on instead of `cpu`.
+// Prefers the CPU it last ran on while its cache is warm there, unless that CPU is notably busier than `cpu`.
+static int sw_wake_cpu(sched_thread_t *thread, int cpu) {
+    int last = thread->last_cpu;
+    if (last == cpu || !SCHED_CPUMASK_HAS(thread->affinity, last) || !sw_cpu_is_running(last)
+        || !sw_cache_hot(thread, time_us())) {
+        return cpu;
+    }
+    int last_load = atomic_load_explicit(&cpu_ctx[last].load_estimate, memory_order_relaxed);
+    int cur_load  = atomic_load_explicit(&cpu_ctx[cpu].load_estimate, memory_order_relaxed);
+    return last_load <= cur_load + SCHED_BALANCE_HYST ? last : cpu;
+}
+
+// Reserve `util` of the EDF utilization of the least-reserved CPU in `mask` that has room for it.
+// Returns the CPU reserved on, or -1 if none of the CPUs can admit the thread.
+static int sw_edf_admit(sched_cpumask_t mask, int util) {
+    while (1) {
+        int best      = -1;
+        int best_util = 0;
+        for (int cpu = 0; cpu < smp_count; cpu++) {
+            if (!SCHED_CPUMASK_HAS(mask, cpu) || !sw_cpu_is_running(cpu)) {
+                continue;
+            }
+            int cur = atomic_load_explicit(&cpu_ctx[cpu].edf_util, memory_order_relaxed);
+            if (cur + util <= SCHED_EDF_MAX_UTIL && (best < 0 || cur < best_util)) {
+                best      = cpu;
+                best_util = cur;
+            }
+        }
+        if (best < 0) {
+            return -1;
+        } else if (atomic_compare_exchange_strong_explicit(
+                       &cpu_ctx[best].edf_util,
+                       &best_util,
+                       best_util + util,
+                       memory_order_relaxed,
+                       memory_order_relaxed
+                   )) {
+            return best;
+        }
+    }
+}
+
+// Move a thread from the EDF class back to the normal class and release its reservation.
+// The thread must not be in any runqueue.
+static void sw_edf_leave(sched_thread_t *thread) {
+    atomic_fetch_sub_explicit(&cpu_ctx[thread->edf.cpu].edf_util, thread->edf.util, memory_order_relaxed);
+    thread->affinity = thread->edf.affinity;
+    thread->edf      = (sched_edf_t){0};
+}
+
+// Interrupt another CPU after handing threads off to it if it is idle or running a lower-priority thread.
+// Handing off an EDF thread always interrupts it, as its deadline may be earlier than that of the running thread.
+static void sw_kick_handoff(sched_cpulocal_t *info, int cpu, int priority) {
+    if (cpu == smp_cur_cpu()) {
+        return;
+    }
+    runqueue_lock(info);
+    sched_thread_t *running = info->current;
+    bool            preempt = !running || running == &info->idle_thread || sw_preempt_prio(running) < priority;
+    runqueue_unlock(info);
+    preempt |= priority == __INT_MAX__;
+    if (preempt) {
+        smp_resched(cpu);
+    }
+}
+
 // Try to hand a thread off to another CPU.
+// Forced handoffs go to another CPU if the thread is not allowed to run on `cpu` or its cache is warm elsewhere;
+// other handoffs fail instead.
 // The thread must not yet be in any runqueue.
 bool thread_handoff(sched_thread_t *thread, int cpu, bool force, int max_load) {
+    if (force) {
+        if (thread->edf.period && !sw_cpu_is_running(thread->edf.cpu)) {
+            // The CPU the reservation is on exited while the thread was blocked; it continues in the normal class.
+            sw_edf_leave(thread);
+        }
+        cpu = sw_affine_cpu(thread, sw_wake_cpu(thread, cpu));
+    } else if (!SCHED_CPUMASK_HAS(thread->affinity, cpu)) {
+        return false;
+    }
     sched_cpulocal_t *info = cpu_ctx + cpu;
     assert_dev_keep(mutex_acquire_shared_from_isr(NULL, &info->run_mtx, TIMESTAMP_US_MAX));
 
     int  flags      = atomic_load(&info->flags);
     bool is_running = (flags & SCHED_RUNNING) && !(flags & SCHED_EXITING);
-    if (!force && !is_running) {
+    if (force && (flags & SCHED_EXITED)) {
+        // The CPU exited after it was picked; pick another one.
+        assert_dev_keep(mutex_release_shared_from_isr(NULL, &info->run_mtx));
+        return thread_handoff(thread, smp_cur_cpu(), true, max_load);
+    } else if (!force && !is_running) {
         return false;
     }
     int  usage     = atomic_load(&thread->timeusage.cpu_usage);
@@ -117,21 +403,124 @@ bool thread_handoff(sched_thread_t *thread, int cpu, bool force, int max_load) {
 
     if (force || has_space) {
         // Scheduler is running and has capacity for this thread.
+        if (force && !thread->wake_time) {
+            // Forced handoffs are wakeups; start measuring wake-to-run latency.
+            thread->wake_time = time_us();
+        }
         assert_dev_keep(mutex_acquire_from_isr(NULL, &info->incoming_mtx, TIMESTAMP_US_MAX));
         dlist_append(&info->incoming, &thread->node);
         assert_dev_keep(mutex_release_from_isr(NULL, &info->incoming_mtx));
+        SCHED_TRACE(SCHEDTRACE_HANDOFF, thread->id, cpu);
+
+        if (is_running) {
+            sw_kick_handoff(info, cpu, sw_preempt_prio(thread));
+        }
     }
 
     assert_dev_keep(mutex_release_shared_from_isr(NULL, &info->run_mtx));
     return (flags & SCHED_RUNNING) && !(flags & SCHED_EXITING);
 }
 
+// Hand a list of woken threads off to a CPU at once.
+// Equivalent to a forced `thread_handoff` of each thread, but only takes the CPU's locks once.
+void thread_handoff_list(dlist_t *threads, int cpu) {
+    // Threads not allowed to run on this CPU or with a warm cache elsewhere are handed off separately.
+    dlist_node_t *node = threads->head;
+    while (node) {
+        sched_thread_t *thread = (sched_thread_t *)node;
+        node                   = node->next;
+        if (!SCHED_CPUMASK_HAS(thread->affinity, cpu) || sw_wake_cpu(thread, cpu) != cpu) {
+            dlist_remove(threads, &thread->node);
+            thread_handoff(thread, cpu, true, 0);
+        }
+    }
+    if (!threads->len) {
+        return;
+    }
+    sched_cpulocal_t *info = cpu_ctx + cpu;
+    assert_dev_keep(mutex_acquire_shared_from_isr(NULL, &info->run_mtx, TIMESTAMP_US_MAX));
+
+    int  flags      = atomic_load(&info->flags);
+    bool is_running = (flags & SCHED_RUNNING) && !(flags & SCHED_EXITING);
+
+    // Add all threads to the load estimate and start measuring wake-to-run latency.
+    timestamp_us_t now      = time_us();
+    int            usage    = 0;
+    int            max_prio = 0;
+    for (node = threads->head; node; node = node->next) {
+        sched_thread_t *thread  = (sched_thread_t *)node;
+        usage                  += atomic_load(&thread->timeusage.cpu_usage);
+        if (!thread->wake_time) {
+            thread->wake_time = now;
+        }
+        if (sw_preempt_prio(thread) > max_prio) {
+            max_prio = sw_preempt_prio(thread);
+        }
+        SCHED_TRACE(SCHEDTRACE_HANDOFF, thread->id, cpu);
+    }
+    atomic_fetch_add_explicit(&info->load_estimate, usage, memory_order_relaxed);
+
+    assert_dev_keep(mutex_acquire_from_isr(NULL, &info->incoming_mtx, TIMESTAMP_US_MAX));
+    dlist_concat(&info->incoming, threads);
+    assert_dev_keep(mutex_release_from_isr(NULL, &info->incoming_mtx));
+
+    if (is_running) {
+        sw_kick_handoff(info, cpu, max_prio);
+    }
+
+    assert_dev_keep(mutex_release_shared_from_isr(NULL, &info->run_mtx));
+}
+
+// Move a queued thread to the runqueue level of its current effective priority.
+// Interrupts must be disabled.
+void thread_requeue(sched_thread_t *thread) {
+    sched_cpulocal_t *info = thread->queue_cpu;
+    if (!info) {
+        return;
+    }
+    runqueue_lock(info);
+    if (thread->queue_cpu != info || thread->queue_prio == runqueue_level(thread)) {
+        // Moved to another CPU in the meantime or already at the right level.
+        runqueue_unlock(info);
+        return;
+    }
+    runqueue_remove(info, thread);
+    runqueue_append(info, thread);
+    runqueue_unlock(info);
+    sw_kick_handoff(info, info - cpu_ctx, sw_preempt_prio(thread));
+}
+
+// Whether a thread is currently running on a CPU other than this one.
+// The result may be stale by the time it is used; it is only a hint for whether spinning is worthwhile.
+bool thread_running_elsewhere(sched_thread_t *thread) {
+    sched_cpulocal_t *info = thread->queue_cpu;
+    return info && info != isr_ctx_get()->cpulocal->sched && info->current == thread;
+}
+
+// Move threads handed over to this CPU into the runqueue.
+static void sw_drain_incoming(sched_cpulocal_t *info) {
+    assert_dev_keep(mutex_acquire_from_isr(NULL, &info->incoming_mtx, TIMESTAMP_US_MAX));
+    runqueue_lock(info);
+    while (info->incoming.len) {
+        sched_thread_t *thread = (void *)dlist_pop_front(&info->incoming);
+        assert_dev_drop(atomic_load(&thread->flags) & THREAD_RUNNING);
+        if (atomic_load(&thread->flags) & THREAD_STARTNOW) {
+            runqueue_prepend(info, thread);
+        } else {
+            runqueue_append(info, thread);
+        }
+    }
+    runqueue_unlock(info);
+    assert_dev_keep(mutex_release_from_isr(NULL, &info->incoming_mtx));
+}
+
 // Handle non-normal scheduler flags.
 static void sw_handle_sched_flags(timestamp_us_t now, int cur_cpu, sched_cpulocal_t *info, int sched_fl) {
     (void)now;
 
     if (!(sched_fl & (SCHED_RUNNING | SCHED_STARTING))) {
         // Mark as starting in the first cycle.
+        atomic_fetch_and(&info->flags, ~SCHED_EXITED);
         atomic_fetch_or(&info->flags, SCHED_STARTING);
 
     } else if (sched_fl & SCHED_STARTING) {
@@ -145,13 +534,35 @@ static void sw_handle_sched_flags(timestamp_us_t now, int cur_cpu, sched_cpuloca
         atomic_store_explicit(&info->load_average, 0, memory_order_relaxed);
         atomic_store_explicit(&info->load_estimate, 0, memory_order_relaxed);
         atomic_fetch_sub_explicit(&running_sched_count, 1, memory_order_relaxed);
+        atomic_fetch_or(&info->flags, SCHED_EXITED);
         atomic_fetch_and(&info->flags, ~(SCHED_RUNNING | SCHED_EXITING));
 
         // Hand all threads over to other CPUs.
         int cpu = 0;
-        dlist_concat(&info->queue, &info->incoming);
-        while (info->queue.len) {
-            sched_thread_t *thread = (void *)dlist_pop_front(&info->queue);
+        sw_drain_incoming(info);
+        while (1) {
+            runqueue_lock(info);
+            sched_thread_t *thread = runqueue_pop(info);
+            if (!thread && info->edf_queue.len) {
+                thread = (sched_thread_t *)info->edf_queue.head;
+                runqueue_remove(info, thread);
+            }
+            runqueue_unlock(info);
+            if (!thread) {
+                break;
+            }
+            if (thread->edf.period) {
+                // The reservation was for this CPU; the thread continues in the normal class.
+                sw_edf_leave(thread);
+            }
+            bool has_cpu = false;
+            for (int i = 0; i < smp_count; i++) {
+                has_cpu |= i != cur_cpu && SCHED_CPUMASK_HAS(thread->affinity, i) && sw_cpu_is_running(i);
+            }
+            if (!has_cpu) {
+                // None of the CPUs this thread is allowed on remain; break its affinity rather than lose it.
+                thread->affinity = SCHED_CPUMASK_ALL;
+            }
             do {
                 cpu = (cpu + 1) % smp_count;
             } while (cpu == cur_cpu || !thread_handoff(thread, cpu, false, __INT_MAX__));
@@ -169,75 +580,137 @@ static void sw_measure_load(timestamp_us_t now, int cur_cpu, sched_cpulocal_t *i
     (void)cur_cpu;
 
     // Measure time usage.
-    timestamp_us_t  used_time = 0;
-    sched_thread_t *thread    = (sched_thread_t *)info->queue.head;
-    while (thread) {
-        used_time += thread->timeusage.cycle_time;
-        thread     = (sched_thread_t *)thread->node.next;
+    runqueue_lock(info);
+    timestamp_us_t used_time = 0;
+    for (int level = -1; level < SCHED_PRIO_LEVELS; level++) {
+        sched_thread_t *thread = (sched_thread_t *)runqueue_list(info, level)->head;
+        while (thread) {
+            used_time += thread->timeusage.cycle_time;
+            thread     = (sched_thread_t *)thread->node.next;
+        }
     }
 
     timestamp_us_t idle_time               = info->idle_thread.timeusage.cycle_time;
     info->idle_thread.timeusage.cycle_time = 0;
     timestamp_us_t total_time              = used_time + idle_time;
+    if (!total_time) {
+        total_time = 1;
+    }
 
-    // Account per-thread CPU usage.
+    // Account per-thread CPU usage as a moving average, so one busy or quiet interval does not cause migrations.
     int total_load = 0;
-    thread         = (sched_thread_t *)info->queue.head;
-    while (thread) {
-        timestamp_us_t cpu_time       = thread->timeusage.cycle_time;
-        thread->timeusage.cycle_time  = 0;
-        int cpu_permil                = (int)(cpu_time * 10000 / total_time);
-        total_load                   += cpu_permil;
-        atomic_store(&thread->timeusage.cpu_usage, cpu_permil);
-        thread = (sched_thread_t *)thread->node.next;
+    for (int level = -1; level < SCHED_PRIO_LEVELS; level++) {
+        sched_thread_t *thread = (sched_thread_t *)runqueue_list(info, level)->head;
+        while (thread) {
+            timestamp_us_t cpu_time       = thread->timeusage.cycle_time;
+            thread->timeusage.cycle_time  = 0;
+            int cpu_permil                = (int)(cpu_time * 10000 / total_time);
+            int usage                     = atomic_load(&thread->timeusage.cpu_usage);
+            usage                        += (cpu_permil - usage) / SCHED_LOAD_EWMA;
+            total_load                   += usage;
+            atomic_store(&thread->timeusage.cpu_usage, usage);
+            thread = (sched_thread_t *)thread->node.next;
+        }
     }
+    runqueue_unlock(info);
 
-    info->load_average  = total_load;
+    // The CPU load average follows the time this CPU was busy; the estimate is what its queued threads will use.
+    int busy            = (int)(used_time * 10000 / total_time);
+    int average         = atomic_load(&info->load_average);
+    info->load_average  = average + (busy - average) / SCHED_LOAD_EWMA;
     info->load_estimate = total_load;
 }
 
-// Perform load balancing.
-static void sw_handle_loadbalance(timestamp_us_t now, int cur_cpu, sched_cpulocal_t *info) {
-    (void)now;
-
-    // Wait for all CPUs to have measured their respective load.
-    atomic_fetch_add(&loadbalance_ready_count, 1);
-    int min = atomic_load(&running_sched_count);
-    while (atomic_load(&loadbalance_ready_count) < min) {
-        isr_pause();
+// Get the thread `cpu` would steal from the runqueue of `peer`, which has `len` queued threads, or NULL if none.
+// That is the highest-priority thread with a cold cache that is not running on `peer`.
+// If all candidates have a warm cache, only the least recently run one is taken, and only if `peer` is backed up.
+// The runqueue of `peer` must be locked.
+static sched_thread_t *sw_steal_candidate(sched_cpulocal_t *peer, int len, int cpu, timestamp_us_t now) {
+    sched_thread_t *hot    = NULL;
+    uint32_t        bitmap = peer->queue_bitmap;
+    while (bitmap) {
+        int             level  = 31 - __builtin_clz(bitmap);
+        sched_thread_t *cand   = (sched_thread_t *)peer->queue[level].head;
+        bitmap                &= ~(1u << level);
+        for (; cand; cand = (sched_thread_t *)cand->node.next) {
+            if (cand == peer->current || !SCHED_CPUMASK_HAS(cand->affinity, cpu)
+                || now - cand->migrated_at < SCHED_MIGRATE_HOLD_US) {
+                continue;
+            } else if (!sw_cache_hot(cand, now)) {
+                return cand;
+            } else if (!hot || cand->last_ran < hot->last_ran) {
+                hot = cand;
+            }
+        }
     }
+    return len >= SCHED_STEAL_HOT_LEN ? hot : NULL;
+}
 
-    // Measure global load average.
-    int global_load_average = 0;
-    for (int i = 0; i < smp_count; i++) {
-        global_load_average += cpu_ctx[i].load_average;
+// Try to steal a runnable thread from the busiest other CPU into this CPU's runqueue.
+// Only threads allowed to run on this CPU and not migrated recently are stolen, to prevent threads ping-ponging.
+// Threads that have not run recently are preferred, as they lose the least cache state by moving.
+// Never spins on another CPU's runqueue; if it is busy, stealing is retried on the next scheduler pass.
+// Returns whether a thread was stolen.
+static bool sw_steal_work(timestamp_us_t now, int cur_cpu, sched_cpulocal_t *info) {
+    // Find the CPU with the most queued threads; a single thread is the one running there.
+    int victim     = -1;
+    int victim_len = 1;
+    for (int cpu = 0; cpu < smp_count; cpu++) {
+        if (cpu == cur_cpu) {
+            continue;
+        }
+        int len = atomic_load_explicit(&cpu_ctx[cpu].queue_len, memory_order_relaxed);
+        if (len > victim_len) {
+            victim     = cpu;
+            victim_len = len;
+        }
+    }
+    if (victim < 0) {
+        return false;
     }
-    global_load_average /= atomic_load(&running_sched_count);
 
-    // If this CPU started with less than the load average, don't hand off any threads.
-    if (info->load_average <= global_load_average) {
-        atomic_fetch_sub(&loadbalance_ready_count, 1);
-        return;
+    sched_cpulocal_t *peer = cpu_ctx + victim;
+    if (atomic_flag_test_and_set_explicit(&peer->queue_lock, memory_order_acquire)) {
+        return false;
+    }
+    sched_thread_t *thread = sw_steal_candidate(peer, victim_len, cur_cpu, now);
+    if (thread) {
+        thread->migrated_at = now;
+        runqueue_remove(peer, thread);
+    }
+    runqueue_unlock(peer);
+    if (!thread) {
+        return false;
     }
 
-    // Hand off threads until either all CPUs expect to meet the load average, or this one dips below.
-    sched_thread_t *thread;
-    for (size_t i = 0; i < info->queue.len; i++) {
-        thread          = (sched_thread_t *)dlist_pop_front(&info->queue);
-        bool handoff_ok = false;
-        for (int cpu = 0; cpu < smp_count; cpu++) {
-            if (cpu == cur_cpu)
-                continue;
-            if (thread_handoff(thread, cpu, false, global_load_average)) {
-                handoff_ok = true;
-                break;
-            }
+    // Move the thread's load estimate over to this CPU.
+    int usage = atomic_load(&thread->timeusage.cpu_usage);
+    atomic_fetch_sub_explicit(&peer->load_estimate, usage, memory_order_relaxed);
+    atomic_fetch_add_explicit(&info->load_estimate, usage, memory_order_relaxed);
+
+    runqueue_lock(info);
+    runqueue_append(info, thread);
+    runqueue_unlock(info);
+    SCHED_TRACE(SCHEDTRACE_MIGRATE, thread->id, victim);
+    return true;
+}
+
+// Wake up a halted idle CPU so it can steal work from this one.
+// Only CPUs that would find a thread to steal are woken, so they don't wake up for scheduler passes that do nothing.
+static void sw_kick_idle(timestamp_us_t now, int cur_cpu, sched_cpulocal_t *info) {
+    int len = atomic_load_explicit(&info->queue_len, memory_order_relaxed);
+    for (int cpu = 0; cpu < smp_count; cpu++) {
+        if (cpu == cur_cpu || cpu_ctx[cpu].current != &cpu_ctx[cpu].idle_thread) {
+            continue;
         }
-        if (!handoff_ok) {
-            dlist_append(&info->queue, &thread->node);
+        runqueue_lock(info);
+        bool stealable = sw_steal_candidate(info, len, cpu, now);
+        runqueue_unlock(info);
+        if (stealable) {
+            smp_resched(cpu);
+            return;
         }
     }
-    atomic_fetch_sub(&loadbalance_ready_count, 1);
 }
 
 // Requests the scheduler to prepare a switch from inside an interrupt routine.
@@ -257,42 +730,50 @@ void sched_request_switch_from_isr() {
     if (cur_thread) {
         timestamp_us_t used               = now - info->last_preempt;
         cur_thread->timeusage.cycle_time += used;
+        cur_thread->last_ran              = now;
         if (cur_thread->flags & THREAD_PRIVILEGED) {
             cur_thread->timeusage.kernel_time += used;
         } else {
             cur_thread->timeusage.user_time += used;
         }
+        if (cur_thread->edf.period) {
+            // Charge the EDF budget of the current period.
+            cur_thread->edf.used += used;
+        }
+    } else if (info->current == &info->idle_thread) {
+        // The idle thread has no thread context; account its time here so it counts as idle time.
+        info->idle_thread.timeusage.cycle_time += now - info->last_preempt;
     }
 
     // Check for load measurement timer.
     if (now >= info->load_measure_time) {
         // Measure load on this CPU.
         sw_measure_load(now, cur_cpu, info);
-        // Balance load with other running CPUs.
-        sw_handle_loadbalance(now, cur_cpu, info);
 
         // Set next timestamp to measure load average.
         info->load_measure_time = now + SCHED_LOAD_INTERVAL - (now % SCHED_LOAD_INTERVAL);
     }
 
     // Check for incoming threads.
-    assert_dev_keep(mutex_acquire_from_isr(NULL, &info->incoming_mtx, TIMESTAMP_US_MAX));
-    while (info->incoming.len) {
-        sched_thread_t *thread = (void *)dlist_pop_front(&info->incoming);
-        assert_dev_drop(atomic_load(&thread->flags) & THREAD_RUNNING);
-        if (atomic_load(&thread->flags) & THREAD_STARTNOW) {
-            dlist_prepend(&info->queue, &thread->node);
-        } else {
-            dlist_append(&info->queue, &thread->node);
-        }
-    }
-    assert_dev_keep(mutex_release_from_isr(NULL, &info->incoming_mtx));
+    sw_drain_incoming(info);
 
     // Check for runnable threads.
-    while (info->queue.len) {
-        // Take the first thread.
-        sched_thread_t *thread = (void *)dlist_pop_front(&info->queue);
-        int             flags  = atomic_load(&thread->flags);
+    while (1) {
+        // Take the EDF thread with the earliest deadline, or else the first thread of the highest priority.
+        runqueue_lock(info);
+        sched_thread_t *thread = runqueue_pop_edf(info, now);
+        if (!thread) {
+            thread = runqueue_pop(info);
+        }
+        runqueue_unlock(info);
+        if (!thread) {
+            // Nothing runnable on this CPU; try to take work from another CPU before idling.
+            if (sw_steal_work(now, cur_cpu, info)) {
+                continue;
+            }
+            break;
+        }
+        int flags = atomic_load(&thread->flags);
 
         // Check for thread exit conditions.
         bool kill_thread = flags & THREAD_EXITING;
@@ -302,11 +783,15 @@ void sched_request_switch_from_isr() {
 
         if (kill_thread) {
             // Exiting thread/process; clean up thread.
+            if (thread->edf.period) {
+                sw_edf_leave(thread);
+            }
             assert_dev_keep(mutex_acquire_from_isr(NULL, &unused_mtx, TIMESTAMP_US_MAX));
             atomic_fetch_or(&thread->flags, THREAD_EXITED);
             atomic_fetch_and(&thread->flags, ~(THREAD_RUNNING | THREAD_EXITING));
             dlist_append(&dead_threads, &thread->node);
             assert_dev_keep(mutex_release_from_isr(NULL, &unused_mtx));
+            waitqueue_notify_all(&thread->join_queue);
 
         } else if (((flags & THREAD_KSUSPEND) || !(flags & THREAD_PRIVILEGED)) && (flags & THREAD_SUSPENDING)) {
             // Userspace and/or kernel thread being suspended.
@@ -320,32 +805,246 @@ void sched_request_switch_from_isr() {
                 newval = flags & ~(THREAD_RUNNING | THREAD_KSUSPEND | THREAD_SUSPENDING);
             } while (!atomic_compare_exchange_strong(&thread->flags, &flags, newval));
 
+        } else if (sw_affine_cpu(thread, cur_cpu) != cur_cpu) {
+            // Thread is no longer allowed to run on this CPU; move it to one it is allowed on.
+            int usage = atomic_load(&thread->timeusage.cpu_usage);
+            atomic_fetch_sub_explicit(&info->load_estimate, usage, memory_order_relaxed);
+            thread_handoff(thread, cur_cpu, true, 0);
+
         } else {
             // Runnable thread found; perform context switch.
             assert_dev_drop(flags & THREAD_RUNNING);
-            dlist_append(&info->queue, &thread->node);
+            runqueue_lock(info);
+            info->current = thread;
+            runqueue_append(info, thread);
+            runqueue_unlock(info);
+            if (idle_tickless && atomic_load(&info->queue_len) > 1) {
+                // More threads than this CPU can run at once; wake an idle CPU to steal some.
+                sw_kick_idle(now, cur_cpu, info);
+            }
             set_switch(info, thread);
             return;
         }
     }
 
     // If nothing is running on this CPU, run the idle thread.
+    runqueue_lock(info);
+    info->current = &info->idle_thread;
+    runqueue_unlock(info);
     set_switch(info, &info->idle_thread);
 }
 
 
 
-// Compare the ID of `sched_thread_t *` to an `int`.
-static int tid_int_cmp(void const *a, void const *b) {
-    sched_thread_t *thread = *(sched_thread_t **)a;
-    tid_t           tid    = (tid_t)(ptrdiff_t)b;
-    return thread->id - tid;
+// Marks a slot in `threads` whose thread was removed; lookups continue past it.
+#define THREADS_TOMBSTONE ((sched_thread_t *)1)
+
+// Get the home slot of `tid` in a thread table with `cap` slots.
+// TIDs are sequential, so they are scattered with Fibonacci hashing; otherwise they would form one long cluster.
+static inline size_t threads_hash(tid_t tid, size_t cap) {
+    return ((uint32_t)tid * 0x9e3779b1u) >> (32 - __builtin_ctz(cap));
+}
+
+// Get the index in `threads` of the thread with TID `tid`, or of the empty slot that ends its probe sequence.
+// `threads_mtx` must be held, shared or exclusive, and `threads_cap` must not be 0.
+static size_t threads_probe(tid_t tid) {
+    size_t mask = threads_cap - 1;
+    size_t i    = threads_hash(tid, threads_cap);
+    while (threads[i] && (threads[i] == THREADS_TOMBSTONE || threads[i]->id != tid)) {
+        i = (i + 1) & mask;
+    }
+    return i;
 }
 
 // Find a thread by TID.
 static sched_thread_t *find_thread(tid_t tid) {
-    array_binsearch_t res = array_binsearch(threads, sizeof(void *), threads_len, (void *)(ptrdiff_t)tid, tid_int_cmp);
-    return res.found ? threads[res.index] : NULL;
+    return threads_cap ? threads[threads_probe(tid)] : NULL;
+}
+
+// Resize the thread table to `cap` slots, dropping all tombstones.
+// `threads_mtx` must be held exclusively.
+static bool threads_resize(size_t cap) {
+    sched_thread_t **mem = malloc(cap * sizeof(sched_thread_t *));
+    if (!mem) {
+        return false;
+    }
+    mem_set(mem, 0, cap * sizeof(sched_thread_t *));
+    for (size_t i = 0; i < threads_cap; i++) {
+        if (!threads[i] || threads[i] == THREADS_TOMBSTONE) {
+            continue;
+        }
+        size_t j = threads_hash(threads[i]->id, cap);
+        while (mem[j]) {
+            j = (j + 1) & (cap - 1);
+        }
+        mem[j] = threads[i];
+    }
+    free(threads);
+    threads      = mem;
+    threads_cap  = cap;
+    threads_used = threads_len;
+    return true;
+}
+
+// Add a thread to the thread table.
+// `threads_mtx` must be held exclusively.
+static bool threads_insert(sched_thread_t *thread) {
+    if ((threads_used + 1) * 4 > threads_cap * 3) {
+        // Keep the table at most 3/4 full; rebuild it at a size where it is at most half full of live threads.
+        size_t cap = 16;
+        while ((threads_len + 1) * 2 > cap) {
+            cap *= 2;
+        }
+        if (!threads_resize(cap)) {
+            return false;
+        }
+    }
+    size_t mask = threads_cap - 1;
+    size_t i    = threads_hash(thread->id, threads_cap);
+    while (threads[i] && threads[i] != THREADS_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    threads_used += !threads[i];
+    threads_len++;
+    threads[i] = thread;
+    return true;
+}
+
+// Remove a thread from the thread table.
+// `threads_mtx` must be held exclusively.
+static void threads_remove(sched_thread_t *thread) {
+    size_t i = threads_probe(thread->id);
+    assert_dev_drop(threads[i] == thread);
+    if (!threads[(i + 1) & (threads_cap - 1)]) {
+        // End of a probe sequence; the slot can be emptied without breaking lookups past it.
+        threads[i] = NULL;
+        threads_used--;
+    } else {
+        threads[i] = THREADS_TOMBSTONE;
+    }
+    threads_len--;
+}
+
+// Construct a cached thread handle without a kernel stack.
+// Slabs construct all of their objects at once, so stacks are only allocated when a handle is taken into use.
+static bool thread_ctor(void *obj) {
+    sched_thread_t *thread      = obj;
+    thread->kernel_stack_bottom = 0;
+    thread->kernel_stack_top    = 0;
+    return true;
+}
+
+// Cache of thread handles; their kernel stacks are only kept while they are in the thread pools.
+static kmem_cache_t thread_cache = KMEM_CACHE_T_INIT("sched_thread_t", sched_thread_t, thread_ctor, NULL);
+
+// Return a thread handle to the thread cache after freeing its kernel stack.
+static void thread_cache_free(sched_thread_t *thread) {
+    free((void *)thread->kernel_stack_bottom);
+    thread->kernel_stack_bottom = 0;
+    thread->kernel_stack_top    = 0;
+    kmem_cache_free(&thread_cache, thread);
+}
+
+// Take a thread handle with its kernel stack from a CPU's pool.
+// Returns NULL if the pool is empty.
+static sched_thread_t *thread_pool_take(sched_cpulocal_t *info) {
+    assert_dev_keep(mutex_acquire_from_isr(NULL, &info->pool_mtx, TIMESTAMP_US_MAX));
+    sched_thread_t *thread = (void *)dlist_pop_front(&info->pool);
+    if (info->pool.len < info->pool_low) {
+        info->pool_low = info->pool.len;
+    }
+    assert_dev_keep(mutex_release_from_isr(NULL, &info->pool_mtx));
+    return thread;
+}
+
+// Return a thread handle and its kernel stack to this CPU's pool, or to the thread cache if the pool is full.
+// The thread's name is always freed.
+static void thread_free(sched_thread_t *thread) {
+    if (thread->name) {
+        free(thread->name);
+        thread->name = NULL;
+    }
+
+    bool              ie     = irq_disable();
+    sched_cpulocal_t *info   = cpu_ctx + smp_cur_cpu();
+    bool              pooled = false;
+    assert_dev_keep(mutex_acquire_from_isr(NULL, &info->pool_mtx, TIMESTAMP_US_MAX));
+    if (info->pool.len < SCHED_THREAD_POOL_MAX) {
+        dlist_append(&info->pool, &thread->node);
+        pooled = true;
+    }
+    assert_dev_keep(mutex_release_from_isr(NULL, &info->pool_mtx));
+    irq_enable_if(ie);
+
+    if (!pooled) {
+        thread_cache_free(thread);
+    }
+}
+
+// Allocate a zeroed thread handle and kernel stack, preferably reusing ones from the thread pools.
+static sched_thread_t *thread_alloc(badge_err_t *ec, char const *name) {
+    // Try this CPU's pool first, then those of the other CPUs.
+    bool            ie     = irq_disable();
+    int             cur    = smp_cur_cpu();
+    sched_thread_t *thread = NULL;
+    for (int i = 0; i < smp_count && !thread; i++) {
+        thread = thread_pool_take(cpu_ctx + (cur + i) % smp_count);
+    }
+    irq_enable_if(ie);
+
+    if (!thread) {
+        thread = kmem_cache_alloc(&thread_cache);
+        if (!thread) {
+            badge_err_set(ec, ELOC_THREADS, ECAUSE_NOMEM);
+            return NULL;
+        }
+    }
+    size_t stack = thread->kernel_stack_bottom;
+    if (!stack) {
+        // Handles from the thread cache don't have a kernel stack yet.
+        stack = (size_t)malloc(CONFIG_STACK_SIZE);
+        if (!stack) {
+            kmem_cache_free(&thread_cache, thread);
+            badge_err_set(ec, ELOC_THREADS, ECAUSE_NOMEM);
+            return NULL;
+        }
+    }
+    mem_set(thread, 0, sizeof(sched_thread_t));
+    thread->kernel_stack_bottom = stack;
+    thread->kernel_stack_top    = stack + CONFIG_STACK_SIZE;
+    waitqueue_init(&thread->join_queue);
+
+    if (name) {
+        size_t name_len = cstr_length(name);
+        thread->name    = malloc(name_len + 1);
+        if (!thread->name) {
+            thread_free(thread);
+            badge_err_set(ec, ELOC_THREADS, ECAUSE_NOMEM);
+            return NULL;
+        }
+        cstr_copy(thread->name, name_len + 1, name);
+    }
+    return thread;
+}
+
+// Return the thread handles that stayed unused in the pools since the previous call to the thread cache.
+// Pools shrink back when thread creation slows down, so the memory is only held while it is being reused.
+static void thread_pool_trim() {
+    for (int cpu = 0; cpu < smp_count; cpu++) {
+        sched_cpulocal_t *info = cpu_ctx + cpu;
+        dlist_t           tmp  = DLIST_EMPTY;
+        assert_dev_keep(mutex_acquire_from_isr(NULL, &info->pool_mtx, TIMESTAMP_US_MAX));
+        while (info->pool_low) {
+            dlist_append(&tmp, dlist_pop_front(&info->pool));
+            info->pool_low--;
+        }
+        info->pool_low = info->pool.len;
+        assert_dev_keep(mutex_release_from_isr(NULL, &info->pool_mtx));
+
+        while (tmp.len) {
+            thread_cache_free((sched_thread_t *)dlist_pop_front(&tmp));
+        }
+    }
 }
 
 // Scheduler housekeeping.
@@ -353,43 +1052,44 @@ static void sched_housekeeping(int taskno, void *arg) {
     (void)taskno;
     (void)arg;
 
-    // Acquire the mutex with interrupts disabled without blocking other threads.
-    while (1) {
-        irq_disable();
-        if (mutex_acquire_from_isr(NULL, &threads_mtx, 500)) {
-            break;
-        }
-        irq_enable();
-        thread_yield();
-    }
-
     // Get list of dead threads.
+    irq_disable();
     assert_dev_keep(mutex_acquire_from_isr(NULL, &unused_mtx, TIMESTAMP_US_MAX));
     dlist_t         tmp  = DLIST_EMPTY;
     sched_thread_t *node = (void *)dead_threads.head;
     while (node) {
         void *next = (void *)node->node.next;
-        if (atomic_load(&node->flags) & THREAD_DETACHED) {
+        if ((atomic_load(&node->flags) & THREAD_DETACHED) && !atomic_load(&node->joiners)) {
             dlist_remove(&dead_threads, &node->node);
             dlist_append(&tmp, &node->node);
         }
         node = next;
     }
     assert_dev_keep(mutex_release_from_isr(NULL, &unused_mtx));
+    irq_enable();
+
+    // Cancel their timers before taking `threads_mtx`; a sleep timer callback on another CPU may be waiting for it.
+    for (node = (void *)tmp.head; node; node = (void *)node->node.next) {
+        time_cancel_timer(&node->timer);
+    }
 
-    // Clean up all dead threads.
+    // Acquire the mutex with interrupts disabled without blocking other threads.
+    while (1) {
+        irq_disable();
+        if (mutex_acquire_from_isr(NULL, &threads_mtx, 500)) {
+            break;
+        }
+        irq_enable();
+        thread_yield();
+    }
+
+    // Clean up all dead threads; their handles and stacks go back to the thread pool.
     while (tmp.len) {
         sched_thread_t *thread = (void *)dlist_pop_front(&tmp);
-        free((void *)thread->kernel_stack_bottom);
-        if (thread->name) {
-            free(thread->name);
-        }
-        array_binsearch_t res =
-            array_binsearch(threads, sizeof(void *), threads_len, (void *)(ptrdiff_t)thread->id, tid_int_cmp);
-        assert_dev_drop(res.found);
-        array_lencap_remove(&threads, sizeof(void *), &threads_len, &threads_cap, NULL, res.index);
-        free(thread);
+        threads_remove(thread);
+        thread_free(thread);
     }
+    thread_pool_trim();
 
     assert_dev_keep(mutex_release_from_isr(NULL, &threads_mtx));
     irq_enable();
@@ -399,7 +1099,17 @@ static void sched_housekeeping(int taskno, void *arg) {
 static void idle_func(void *arg) {
     (void)arg;
     while (1) {
-        isr_pause();
+        irq_disable();
+        sched_cpulocal_t *info = isr_ctx_get()->cpulocal->sched;
+        if (idle_tickless && !atomic_load(&info->queue_len) && !info->incoming.len) {
+            // Nothing to run; halt until a timer task, reschedule request or other interrupt arrives.
+            timestamp_us_t start = time_us();
+            isr_wait();
+            info->idle_residency += time_us() - start;
+        } else {
+            isr_pause();
+        }
+        irq_enable();
         thread_yield();
     }
 }
@@ -412,6 +1122,7 @@ void sched_init() {
     for (int i = 0; i < smp_count; i++) {
         cpu_ctx[i].run_mtx      = MUTEX_T_INIT_SHARED_ISR;
         cpu_ctx[i].incoming_mtx = MUTEX_T_INIT_ISR;
+        cpu_ctx[i].pool_mtx     = MUTEX_T_INIT_ISR;
         void *stack             = malloc(8192);
         assert_always(stack);
         cpu_ctx[i].idle_thread.kernel_stack_bottom  = (size_t)stack;
@@ -420,6 +1131,7 @@ void sched_init() {
         cpu_ctx[i].idle_thread.flags                = THREAD_PRIVILEGED;
         sched_prepare_kernel_entry(&cpu_ctx[i].idle_thread, idle_func, NULL);
     }
+    idle_tickless = smp_count == 1 || smp_has_resched();
     hk_add_repeated(0, 1000000, sched_housekeeping, NULL);
 }
 
@@ -471,6 +1183,7 @@ void sched_exec() {
     info->load_average      = 0;
     info->load_estimate     = 0;
     info->load_measure_time = now + SCHED_LOAD_INTERVAL - (now % SCHED_LOAD_INTERVAL);
+    info->edf_replenish     = TIMESTAMP_US_MAX;
     atomic_store_explicit(&info->flags, 0, memory_order_release);
 
     // Start handed over threads or idle until one is handed over to this CPU.
@@ -486,6 +1199,16 @@ void sched_exit(int cpu) {
     assert_dev_keep(mutex_release(NULL, &cpu_ctx[cpu].run_mtx));
 }
 
+// Get the wake-to-run latency statistics of a CPU.
+void sched_get_wakestat(int cpu, sched_wakestat_t *out) {
+    assert_dev_drop(cpu >= 0 && cpu < smp_count);
+    bool ie = irq_disable();
+    runqueue_lock(&cpu_ctx[cpu]);
+    *out = cpu_ctx[cpu].wakestat;
+    runqueue_unlock(&cpu_ctx[cpu]);
+    irq_enable_if(ie);
+}
+
 
 
 // Returns the current thread ID.
@@ -512,36 +1235,15 @@ tid_t thread_new_user(
     badge_err_t *ec, char const *name, process_t *process, size_t user_entrypoint, size_t user_arg, int priority
 ) {
     // Allocate thread.
-    sched_thread_t *thread = malloc(sizeof(sched_thread_t));
+    sched_thread_t *thread = thread_alloc(ec, name);
     if (!thread) {
-        badge_err_set(ec, ELOC_THREADS, ECAUSE_NOMEM);
-        return 0;
-    }
-    mem_set(thread, 0, sizeof(sched_thread_t));
-
-    thread->kernel_stack_bottom = (size_t)malloc(CONFIG_STACK_SIZE);
-    if (!thread->kernel_stack_bottom) {
-        free(thread);
-        badge_err_set(ec, ELOC_THREADS, ECAUSE_NOMEM);
         return 0;
     }
 
-    if (name) {
-        size_t name_len = cstr_length(name);
-        thread->name    = malloc(name_len + 1);
-        if (!thread->name) {
-            free((void *)thread->kernel_stack_bottom);
-            free(thread);
-            badge_err_set(ec, ELOC_THREADS, ECAUSE_NOMEM);
-            return 0;
-        }
-        cstr_copy(thread->name, name_len + 1, name);
-    }
-
     thread->priority              = priority;
+    thread->affinity              = SCHED_CPUMASK_ALL;
     thread->process               = process;
     thread->id                    = atomic_fetch_add(&tid_counter, 1);
-    thread->kernel_stack_top      = thread->kernel_stack_bottom + CONFIG_STACK_SIZE;
     thread->kernel_isr_ctx.flags  = ISR_CTX_FLAG_KERNEL;
     thread->kernel_isr_ctx.thread = thread;
     thread->user_isr_ctx.thread   = thread;
@@ -551,14 +1253,10 @@ tid_t thread_new_user(
     sched_prepare_user_entry(thread, user_entrypoint, user_arg);
 
     assert_dev_keep(mutex_acquire(NULL, &threads_mtx, TIMESTAMP_US_MAX));
-    bool success = array_lencap_insert(&threads, sizeof(void *), &threads_len, &threads_cap, &thread, threads_len);
+    bool success = threads_insert(thread);
     assert_dev_keep(mutex_release(NULL, &threads_mtx));
     if (!success) {
-        if (thread->name) {
-            free(thread->name);
-        }
-        free((void *)thread->kernel_stack_bottom);
-        free(thread);
+        thread_free(thread);
         badge_err_set(ec, ELOC_THREADS, ECAUSE_NOMEM);
         return 0;
     }
@@ -569,49 +1267,24 @@ tid_t thread_new_user(
 // Create new suspended kernel thread.
 tid_t thread_new_kernel(badge_err_t *ec, char const *name, sched_entry_t entrypoint, void *arg, int priority) {
     // Allocate thread.
-    sched_thread_t *thread = malloc(sizeof(sched_thread_t));
+    sched_thread_t *thread = thread_alloc(ec, name);
     if (!thread) {
-        badge_err_set(ec, ELOC_THREADS, ECAUSE_NOMEM);
         return 0;
     }
-    mem_set(thread, 0, sizeof(sched_thread_t));
-
-    thread->kernel_stack_bottom = (size_t)malloc(CONFIG_STACK_SIZE);
-    if (!thread->kernel_stack_bottom) {
-        free(thread);
-        badge_err_set(ec, ELOC_THREADS, ECAUSE_NOMEM);
-        return 0;
-    }
-
-    if (name) {
-        size_t name_len = cstr_length(name);
-        thread->name    = malloc(name_len + 1);
-        if (!thread->name) {
-            free((void *)thread->kernel_stack_bottom);
-            free(thread);
-            badge_err_set(ec, ELOC_THREADS, ECAUSE_NOMEM);
-            return 0;
-        }
-        cstr_copy(thread->name, name_len + 1, name);
-    }
 
     thread->priority               = priority;
+    thread->affinity               = SCHED_CPUMASK_ALL;
     thread->id                     = atomic_fetch_add(&tid_counter, 1);
-    thread->kernel_stack_top       = thread->kernel_stack_bottom + CONFIG_STACK_SIZE;
     thread->kernel_isr_ctx.flags   = ISR_CTX_FLAG_KERNEL;
     thread->kernel_isr_ctx.thread  = thread;
     thread->flags                 |= THREAD_PRIVILEGED | THREAD_KERNEL;
     sched_prepare_kernel_entry(thread, entrypoint, arg);
 
     assert_dev_keep(mutex_acquire(NULL, &threads_mtx, TIMESTAMP_US_MAX));
-    bool success = array_lencap_insert(&threads, sizeof(void *), &threads_len, &threads_cap, &thread, threads_len);
+    bool success = threads_insert(thread);
     assert_dev_keep(mutex_release(NULL, &threads_mtx));
     if (!success) {
-        if (thread->name) {
-            free(thread->name);
-        }
-        free((void *)thread->kernel_stack_bottom);
-        free(thread);
+        thread_free(thread);
         badge_err_set(ec, ELOC_THREADS, ECAUSE_NOMEM);
         return 0;
     }
@@ -653,21 +1326,97 @@ static void thread_resume_from_timer(void *cookie) {
 // Set thread wakeup timer.
 static void thread_set_wake_time(timestamp_us_t time) {
     sched_thread_t *thread = sched_current_thread();
-    time_add_async_task(time, thread_resume_from_timer, (void *)(long)thread->id);
+    assert_dev_keep(time_add_timer(&thread->timer, time, thread_resume_from_timer, (void *)(long)thread->id));
+}
+
+// Hand a sleeping thread back to the scheduler from its timer.
+static void thread_wake_from_timer(void *cookie) {
+    thread_handoff(cookie, smp_cur_cpu(), true, 0);
 }
 
 // Sleep for an amount of microseconds.
 void thread_sleep(timestamp_us_t delay) {
-    // Set the sleep timer; the kernel thread will yield and wake up later.
-    thread_set_wake_time(time_us() + delay);
-    thread_suspend(NULL, sched_current_tid(), true);
+    // Leave the runqueue and let this thread's own timer hand it back; the timer can't fire before the switch.
+    irq_disable();
+    sched_thread_t *self = thread_dequeue_self();
+    assert_dev_keep(time_add_timer(&self->timer, time_us() + delay, thread_wake_from_timer, self));
+    thread_yield();
 }
 
 // Implementation of thread yield system call.
+// EDF threads give up the rest of their budget and run again in their next period.
 void syscall_thread_yield() {
+    irq_disable();
+    sched_thread_t *self = sched_current_thread();
+    if (self->edf.period) {
+        self->edf.used = self->edf.runtime;
+    }
+    irq_enable();
     thread_yield();
 }
 
+// Whether `tid` is a thread of the calling thread's process.
+static bool thread_is_own(tid_t tid) {
+    sched_thread_t *self = sched_current_thread();
+    assert_always(mutex_acquire_shared(NULL, &threads_mtx, TIMESTAMP_US_MAX));
+    sched_thread_t *thread = find_thread(tid);
+    bool            own    = thread && thread->process == self->process;
+    assert_always(mutex_release_shared(NULL, &threads_mtx));
+    return own;
+}
+
+// Set the CPUs a thread of this process is allowed to run on.
+// If `tid` is 0, sets the affinity of the calling thread.
+// Returns 0 on success, or a (negative) errno on failure.
+int syscall_thread_set_affinity(tid_t tid, uint64_t mask) {
+    if (!tid) {
+        tid = sched_current_tid();
+    }
+    if (!thread_is_own(tid)) {
+        return -ESRCH;
+    }
+    badge_err_t ec = {0};
+    thread_set_affinity(&ec, tid, mask);
+    if (ec.cause == ECAUSE_PARAM) {
+        return -EINVAL;
+    } else if (!badge_err_is_ok(&ec)) {
+        return -ESRCH;
+    }
+    return 0;
+}
+
+// Get the CPUs a thread of this process is allowed to run on.
+// If `tid` is 0, gets the affinity of the calling thread.
+// Returns 0 on success, or a (negative) errno on failure.
+int syscall_thread_get_affinity(tid_t tid, uint64_t *mask) {
+    if (!tid) {
+        tid = sched_current_tid();
+    }
+    if (!thread_is_own(tid)) {
+        return -ESRCH;
+    }
+    badge_err_t     ec  = {0};
+    sched_cpumask_t res = thread_get_affinity(&ec, tid);
+    if (!badge_err_is_ok(&ec)) {
+        return -ESRCH;
+    }
+    sigsegv_assert(copy_to_user(proc_current_pid(), (size_t)mask, &res, sizeof(res)), (size_t)mask);
+    return 0;
+}
+
+// Move the calling thread into the earliest-deadline-first class, or back into the normal class if `runtime` is 0.
+// Returns 0 on success, or a (negative) errno on failure.
+int syscall_thread_set_edf(timestamp_us_t runtime, timestamp_us_t period) {
+    badge_err_t ec = {0};
+    thread_set_edf(&ec, runtime, period);
+    if (ec.cause == ECAUSE_NOSPACE) {
+        return -EBUSY;
+    } else if (!badge_err_is_ok(&ec)) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
 // Implementation of usleep system call.
 void syscall_thread_sleep(timestamp_us_t delay) {
     // Set the sleep timer; the thread will drop to user mode and then pause.
@@ -801,6 +1550,106 @@ bool thread_is_running(badge_err_t *ec, tid_t tid) {
     return res;
 }
 
+// Set the CPUs a thread is allowed to run on; the mask must include at least one existing CPU.
+// A thread that is on a CPU it is no longer allowed on is moved the next time that CPU schedules it.
+void thread_set_affinity(badge_err_t *ec, tid_t tid, sched_cpumask_t mask) {
+    bool has_cpu = false;
+    for (int i = 0; i < smp_count; i++) {
+        has_cpu |= SCHED_CPUMASK_HAS(mask, i);
+    }
+    if (!has_cpu) {
+        badge_err_set(ec, ELOC_THREADS, ECAUSE_PARAM);
+        return;
+    }
+
+    assert_always(mutex_acquire_shared(NULL, &threads_mtx, TIMESTAMP_US_MAX));
+    sched_thread_t *thread = find_thread(tid);
+    if (thread && thread->edf.period) {
+        // EDF threads stay on the CPU they are reserved on; the mask applies once they leave the EDF class.
+        thread->edf.affinity = mask;
+        badge_err_set_ok(ec);
+    } else if (thread) {
+        thread->affinity = mask;
+        badge_err_set_ok(ec);
+    } else {
+        badge_err_set(ec, ELOC_THREADS, ECAUSE_NOTFOUND);
+    }
+    assert_always(mutex_release_shared(NULL, &threads_mtx));
+
+    if (thread && thread == sched_current_thread() && !SCHED_CPUMASK_HAS(mask, smp_cur_cpu())) {
+        // Let the scheduler move this thread off of this CPU right away.
+        thread_yield();
+    }
+}
+
+// Get the CPUs a thread is allowed to run on.
+sched_cpumask_t thread_get_affinity(badge_err_t *ec, tid_t tid) {
+    assert_always(mutex_acquire_shared(NULL, &threads_mtx, TIMESTAMP_US_MAX));
+    sched_thread_t *thread = find_thread(tid);
+    sched_cpumask_t mask   = 0;
+    if (thread) {
+        mask = thread->affinity;
+        badge_err_set_ok(ec);
+    } else {
+        badge_err_set(ec, ELOC_THREADS, ECAUSE_NOTFOUND);
+    }
+    assert_always(mutex_release_shared(NULL, &threads_mtx));
+    return mask;
+}
+
+// Move the calling thread into the earliest-deadline-first class with a budget of `runtime` every `period`.
+// If `runtime` is 0, moves the calling thread back into the normal class instead.
+// Fails with `ECAUSE_PARAM` unless `SCHED_EDF_MIN_US` <= `runtime` <= `period` <= `SCHED_EDF_MAX_US`.
+// Admission fails with `ECAUSE_NOSPACE` if no CPU the thread is allowed on has enough utilization left.
+// Changing the parameters of an EDF thread needs room for both the old and new reservation.
+void thread_set_edf(badge_err_t *ec, timestamp_us_t runtime, timestamp_us_t period) {
+    if (runtime && (runtime < SCHED_EDF_MIN_US || period < runtime || period > SCHED_EDF_MAX_US)) {
+        badge_err_set(ec, ELOC_THREADS, ECAUSE_PARAM);
+        return;
+    }
+    sched_thread_t *self = sched_current_thread();
+
+    // Reserve utilization on a CPU for the new parameters, rounding up.
+    int util = 0;
+    int cpu  = -1;
+    if (runtime) {
+        util = (int)((runtime * 10000 + period - 1) / period);
+        cpu  = sw_edf_admit(self->edf.period ? self->edf.affinity : self->affinity, util);
+        if (cpu < 0) {
+            badge_err_set(ec, ELOC_THREADS, ECAUSE_NOSPACE);
+            return;
+        }
+    }
+
+    // Move this thread to the queue of its new class; it stays in this CPU's runqueue while running.
+    bool              ie   = irq_disable();
+    sched_cpulocal_t *info = self->queue_cpu;
+    runqueue_lock(info);
+    runqueue_remove(info, self);
+    if (self->edf.period) {
+        sw_edf_leave(self);
+    }
+    if (runtime) {
+        self->edf = (sched_edf_t){
+            .runtime  = runtime,
+            .period   = period,
+            .deadline = time_us() + period,
+            .used     = 0,
+            .util     = util,
+            .cpu      = cpu,
+            .affinity = self->affinity,
+        };
+        self->affinity = (sched_cpumask_t)1 << cpu;
+    }
+    runqueue_append(info, self);
+    runqueue_unlock(info);
+    irq_enable_if(ie);
+    badge_err_set_ok(ec);
+
+    // Let the scheduler move this thread to the CPU it is reserved on right away.
+    thread_yield();
+}
+
 
 // Exits the current thread.
 // If the thread is detached, resources will be cleaned up.
@@ -819,17 +1668,20 @@ void thread_join(tid_t tid) {
     while (1) {
         assert_always(mutex_acquire_shared(NULL, &threads_mtx, TIMESTAMP_US_MAX));
         sched_thread_t *thread = find_thread(tid);
-        if (thread) {
-            if (atomic_load(&thread->flags) & THREAD_EXITED) {
-                atomic_fetch_or(&thread->flags, THREAD_DETACHED);
-                assert_always(mutex_release_shared(NULL, &threads_mtx));
-                return;
-            }
-        } else {
+        if (!thread) {
+            assert_always(mutex_release_shared(NULL, &threads_mtx));
+            return;
+        }
+        int seq = waitqueue_seq(&thread->join_queue);
+        if (atomic_load(&thread->flags) & THREAD_EXITED) {
+            atomic_fetch_or(&thread->flags, THREAD_DETACHED);
             assert_always(mutex_release_shared(NULL, &threads_mtx));
             return;
         }
+        // Keep the thread from being reaped while this thread waits on its join queue.
+        atomic_fetch_add(&thread->joiners, 1);
         assert_always(mutex_release_shared(NULL, &threads_mtx));
-        thread_yield();
+        waitqueue_block(&thread->join_queue, seq, -1);
+        atomic_fetch_sub(&thread->joiners, 1);
     }
 }
@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: MIT
+
+#include "scheduler/trace.h"
+
+#include "errno.h"
+#include "interrupt.h"
+#include "smp.h"
+#include "syscall_util.h"
+#include "time.h"
+#include "usercopy.h"
+
+#include <stdatomic.h>
+
+#if CONFIG_SCHED_TRACE
+
+// Maximum number of CPUs that scheduler events are traced for.
+#define SCHED_TRACE_MAX_CPUS 8
+// Number of records in each CPU's trace buffer.
+#define SCHED_TRACE_LEN      256
+
+// Slot in a scheduler trace buffer.
+typedef struct {
+    // Index of the record in this slot, or `UINT32_MAX` while it is being written.
+    atomic_uint      seq;
+    // Trace record.
+    schedtrace_rec_t rec;
+} sched_trace_slot_t;
+
+// Per-CPU scheduler trace ring buffer.
+// Only the owning CPU writes to it, with interrupts disabled, so no locks are needed.
+typedef struct {
+    // Total number of records written; the next record goes in slot `head % SCHED_TRACE_LEN`.
+    atomic_uint        head;
+    // Trace record slots.
+    sched_trace_slot_t slots[SCHED_TRACE_LEN];
+} sched_trace_buf_t;
+
+// Per-CPU scheduler trace buffers.
+static sched_trace_buf_t trace_bufs[SCHED_TRACE_MAX_CPUS];
+
+
+
+// Append an event to this CPU's scheduler trace buffer.
+// Never takes any locks, so it can be called from anywhere in the scheduler.
+void sched_trace(int event, int tid, int arg) {
+    bool ie  = irq_disable();
+    int  cpu = smp_cur_cpu();
+    if (cpu >= 0 && cpu < SCHED_TRACE_MAX_CPUS) {
+        sched_trace_buf_t  *buf  = &trace_bufs[cpu];
+        unsigned            head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+        sched_trace_slot_t *slot = &buf->slots[head % SCHED_TRACE_LEN];
+
+        // Invalidate the slot before overwriting it so readers can detect torn records.
+        atomic_store_explicit(&slot->seq, UINT32_MAX, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        slot->rec = (schedtrace_rec_t){
+            .time  = time_us(),
+            .tid   = tid,
+            .event = event,
+            .arg   = arg,
+        };
+        atomic_store_explicit(&slot->seq, head, memory_order_release);
+        atomic_store_explicit(&buf->head, head + 1, memory_order_release);
+    }
+    irq_enable_if(ie);
+}
+
+#endif
+
+
+
+// Copy up to `cap` of the most recent scheduler trace records of `cpu` to `records`, oldest first.
+// Returns the number of records copied, or a (negative) errno on failure.
+int syscall_sys_schedtrace(int cpu, schedtrace_rec_t *records, int cap) {
+#if CONFIG_SCHED_TRACE
+    if (cpu < 0 || cpu >= smp_count || cpu >= SCHED_TRACE_MAX_CPUS || cap < 0) {
+        return -EINVAL;
+    }
+    sched_trace_buf_t *buf   = &trace_bufs[cpu];
+    unsigned           head  = atomic_load_explicit(&buf->head, memory_order_acquire);
+    unsigned           avail = head < SCHED_TRACE_LEN ? head : SCHED_TRACE_LEN;
+    if (avail > (unsigned)cap) {
+        avail = cap;
+    }
+
+    int count = 0;
+    for (unsigned i = head - avail; i != head; i++) {
+        sched_trace_slot_t *slot = &buf->slots[i % SCHED_TRACE_LEN];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != i) {
+            // Already overwritten by newer records.
+            continue;
+        }
+        schedtrace_rec_t rec = slot->rec;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != i) {
+            // Overwritten while it was being copied.
+            continue;
+        }
+        sigsegv_assert(
+            copy_to_user(proc_current_pid(), (size_t)(records + count), &rec, sizeof(rec)),
+            (size_t)(records + count)
+        );
+        count++;
+    }
+    return count;
+#else
+    (void)cpu;
+    (void)records;
+    (void)cap;
+    return -ENOSYS;
+#endif
+}
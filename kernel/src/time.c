@@ -3,72 +3,186 @@
 
 #include "time.h"
 
-#include "arrays.h"
 #include "cpulocal.h"
 #include "interrupt.h"
 #include "isr_ctx.h"
 #include "scheduler/isr.h"
+#include "smp.h"
 #include "spinlock.h"
 #include "time_private.h"
 
 
 
-// Spinlock for list of unclaimed timer tasks.
-static spinlock_t tasks_spinlock = SPINLOCK_T_INIT_SHARED;
+// Mask for a timing wheel slot index.
+#define WHEEL_MASK (TIME_WHEEL_SLOTS - 1)
 
-// Length of timer tasks array.
-static size_t        tasks_len;
-// Capacity of timer tasks array.
-static size_t        tasks_cap;
-// Global timer tasks array.
-static timertask_t **tasks;
 
 
-// Timer task counter.
-static int64_t taskno_counter;
+// Find the distance from slot `cur` to the first non-empty slot at or after it, wrapping around.
+static inline int wheel_slot_distance(uint64_t bitmap, int cur) {
+    uint64_t rotated = cur ? (bitmap >> cur) | (bitmap << (TIME_WHEEL_SLOTS - cur)) : bitmap;
+    return __builtin_ctzll(rotated);
+}
 
+// Add a timer to the slot matching its timestamp.
+static void wheel_insert(time_wheel_t *wheel, timer_node_t *timer) {
+    int64_t expires = timer->timestamp >> TIME_WHEEL_TICK_SHIFT;
+    if (expires < wheel->tick) {
+        // Timers that are already due go in the current slot.
+        expires = wheel->tick;
+    }
+    int64_t delta = expires - wheel->tick;
 
-// Comparator for timer tasks by timestamp.
-int timertask_timestamp_cmp(void const *a_ptr, void const *b_ptr) {
-    timertask_t const *a = *(void *const *)a_ptr;
-    timertask_t const *b = *(void *const *)b_ptr;
-    if (a->timestamp < b->timestamp) {
-        return 1;
-    } else if (a->timestamp > b->timestamp) {
-        return -1;
-    } else {
-        return 0;
+    // Each level covers `TIME_WHEEL_SLOTS` times the range of the previous one.
+    int level = 0;
+    while (level < TIME_WHEEL_LEVELS - 1 && delta >> (TIME_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    if (delta >> (TIME_WHEEL_BITS * TIME_WHEEL_LEVELS)) {
+        // Too far ahead for the wheel; park it in the last slot and re-insert it when it cascades.
+        expires = wheel->tick + (1ll << (TIME_WHEEL_BITS * TIME_WHEEL_LEVELS)) - 1;
+    }
+
+    int index   = (expires >> (TIME_WHEEL_BITS * level)) & WHEEL_MASK;
+    timer->slot = &wheel->slots[level][index];
+    dlist_append(timer->slot, &timer->node);
+    wheel->bitmap[level] |= 1ull << index;
+}
+
+// Remove a timer from its slot.
+static void wheel_remove(time_wheel_t *wheel, timer_node_t *timer) {
+    dlist_remove(timer->slot, &timer->node);
+    if (!timer->slot->len) {
+        size_t off                             = timer->slot - &wheel->slots[0][0];
+        wheel->bitmap[off / TIME_WHEEL_SLOTS] &= ~(1ull << (off % TIME_WHEEL_SLOTS));
     }
+    timer->slot = NULL;
 }
 
-// Comparator for timer tasks by ID.
-int timertask_id_cmp(void const *a_ptr, void const *b_ptr) {
-    timertask_t const *a = *(void *const *)a_ptr;
-    timertask_t const *b = *(void *const *)b_ptr;
-    if (a->taskno < b->taskno) {
-        return -1;
-    } else if (a->taskno > b->taskno) {
-        return 1;
+// Move all timers in a slot of a higher level down to the slots matching the current tick.
+static void wheel_cascade(time_wheel_t *wheel, int level) {
+    int      index = (wheel->tick >> (TIME_WHEEL_BITS * level)) & WHEEL_MASK;
+    dlist_t *slot  = &wheel->slots[level][index];
+    dlist_t  tmp   = DLIST_EMPTY;
+    while (slot->len) {
+        dlist_append(&tmp, dlist_pop_front(slot));
+    }
+    wheel->bitmap[level] &= ~(1ull << index);
+    while (tmp.len) {
+        timer_node_t *timer = (timer_node_t *)dlist_pop_front(&tmp);
+        wheel_insert(wheel, timer);
+    }
+}
+
+// Get the first tick at which a level of the timing wheel has work to do.
+static int64_t wheel_level_next_tick(time_wheel_t *wheel, int level) {
+    if (!wheel->bitmap[level]) {
+        return INT64_MAX;
+    }
+    int     shift = TIME_WHEEL_BITS * level;
+    int64_t pos   = wheel->tick >> shift;
+    int     dist;
+    if (level) {
+        // Higher levels' current slots are only cascaded when the wheel comes around to them again.
+        dist = 1 + wheel_slot_distance(wheel->bitmap[level], (pos + 1) & WHEEL_MASK);
     } else {
-        return 0;
+        dist = wheel_slot_distance(wheel->bitmap[level], pos & WHEEL_MASK);
     }
+    return (pos + dist) << shift;
+}
+
+// Get the first tick at which the timing wheel has work to do.
+static int64_t wheel_next_tick(time_wheel_t *wheel, int first_level) {
+    int64_t next = INT64_MAX;
+    for (int level = first_level; level < TIME_WHEEL_LEVELS; level++) {
+        int64_t tick = wheel_level_next_tick(wheel, level);
+        if (tick < next) {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+// Advance the timing wheel to at most `target`, cascading any higher-level slots reached on the way.
+// The first level's current slot must be empty.
+static void wheel_advance(time_wheel_t *wheel, int64_t target) {
+    int64_t next = wheel_next_tick(wheel, 0);
+    if (next > target) {
+        next = target;
+    }
+    wheel->tick = next;
+    for (int level = TIME_WHEEL_LEVELS - 1; level > 0; level--) {
+        if (!(next & ((1ll << (TIME_WHEEL_BITS * level)) - 1))) {
+            wheel_cascade(wheel, level);
+        }
+    }
+}
+
+// Remove and return the first timer that is due at `now`, if any.
+static timer_node_t *wheel_pop_expired(time_wheel_t *wheel, timestamp_us_t now) {
+    int64_t now_tick = now >> TIME_WHEEL_TICK_SHIFT;
+    while (1) {
+        dlist_t      *slot  = &wheel->slots[0][wheel->tick & WHEEL_MASK];
+        timer_node_t *timer = (timer_node_t *)slot->head;
+        while (timer) {
+            if (timer->timestamp <= now) {
+                wheel_remove(wheel, timer);
+                return timer;
+            }
+            timer = (timer_node_t *)timer->node.next;
+        }
+        if (wheel->tick >= now_tick) {
+            return NULL;
+        }
+        wheel_advance(wheel, now_tick);
+    }
+}
+
+// Get the time at which the timing wheel next needs attention.
+static timestamp_us_t wheel_next_deadline(time_wheel_t *wheel) {
+    timestamp_us_t deadline = TIMESTAMP_US_MAX;
+
+    // The first level is ordered by tick; the first non-empty slot has the earliest timers.
+    int64_t tick = wheel_level_next_tick(wheel, 0);
+    if (tick < INT64_MAX) {
+        timer_node_t *timer = (timer_node_t *)wheel->slots[0][tick & WHEEL_MASK].head;
+        while (timer) {
+            if (timer->timestamp < deadline) {
+                deadline = timer->timestamp;
+            }
+            timer = (timer_node_t *)timer->node.next;
+        }
+    }
+
+    // Higher levels need to be cascaded when the wheel reaches them.
+    tick = wheel_next_tick(wheel, 1);
+    if (tick < INT64_MAX && tick < (deadline >> TIME_WHEEL_TICK_SHIFT)) {
+        deadline = tick << TIME_WHEEL_TICK_SHIFT;
+    }
+
+    return deadline;
 }
 
 
 
 // Evaluate the timer for this CPU.
 static void eval_cpu_timer(time_cpulocal_t *ctx) {
-    spinlock_take_shared(&tasks_spinlock);
-    if (tasks_len && (ctx->preempt_time <= 0 || tasks[tasks_len - 1]->timestamp < ctx->preempt_time)) {
-        // There is a timer task scheduled that will run first.
+    spinlock_take(&ctx->wheel.lock);
+    timestamp_us_t deadline = wheel_next_deadline(&ctx->wheel);
+    spinlock_release(&ctx->wheel.lock);
+    if (deadline < TIMESTAMP_US_MAX && (ctx->preempt_time <= 0 || deadline < ctx->preempt_time)) {
+        // There is a timer scheduled that will run first.
         ctx->timer_is_preempt = false;
-        time_set_cpu_timer(tasks[0]->timestamp);
-    } else {
-        // No task or the task will run after the preemption.
+        time_set_cpu_timer(deadline);
+    } else if (ctx->preempt_time < TIMESTAMP_US_MAX) {
+        // No timer or the timer will run after the preemption.
         ctx->timer_is_preempt = true;
         time_set_cpu_timer(ctx->preempt_time);
+    } else {
+        // No timer and no preemption; nothing to wake up for.
+        ctx->timer_is_preempt = true;
+        time_clear_cpu_timer();
     }
-    spinlock_release_shared(&tasks_spinlock);
 }
 
 // Sets the alarm time when the next task switch should occur.
@@ -78,84 +192,85 @@ void time_set_next_task_switch(timestamp_us_t timestamp) {
     eval_cpu_timer(ctx);
 }
 
-// Attach a task to a timer interrupt.
-// The task with the lowest timestamp is likeliest, but not guaranteed, to run first.
-// Returns timer ID on success, -1 on failure.
-int64_t time_add_async_task(timestamp_us_t timestamp, timer_fn_t callback, void *cookie) {
-    // Allocate timer task.
-    timertask_t *task = malloc(sizeof(timertask_t));
-    if (!task) {
-        return -1;
-    }
-    spinlock_take(&tasks_spinlock);
-    int64_t taskno = taskno_counter;
-    taskno_counter++;
-    spinlock_release(&tasks_spinlock);
-    task->taskno    = taskno;
-    task->timestamp = timestamp;
-    task->callback  = callback;
-    task->cookie    = cookie;
+// Wait for the callback of `timer` to finish if it is running on another CPU.
+// A callback running on this CPU is the caller itself, or interrupted it and has already finished.
+static void timer_wait_callback(timer_node_t *timer) {
+    int cpu = smp_cur_cpu() + 1;
+    int running;
+    while ((running = atomic_load(&timer->running)) && running != cpu) {
+        isr_pause();
+    }
+}
 
+// Arm a timer on this CPU to run `callback` at `timestamp`.
+// If the previous callback is still running on another CPU, waits for it to finish first.
+// Returns false if the timer was already armed.
+bool time_add_timer(timer_node_t *timer, timestamp_us_t timestamp, timer_fn_t callback, void *cookie) {
     // Interrupts must be disabled while holding spinlock.
-    bool ie = irq_disable();
-
-    // Take spinlock while inserting into the list.
-    spinlock_take(&tasks_spinlock);
-
-    // Insert into task array.
-    if (!array_lencap_sorted_insert(&tasks, sizeof(void *), &tasks_len, &tasks_cap, &task, timertask_timestamp_cmp)) {
-        goto error;
+    bool             ie    = irq_disable();
+    time_cpulocal_t *ctx   = &isr_ctx_get()->cpulocal->time;
+    time_wheel_t    *wheel = &ctx->wheel;
+
+    // The callback may still be reading the cookie the timer was armed with.
+    timer_wait_callback(timer);
+    if (atomic_load(&timer->wheel)) {
+        irq_enable_if(ie);
+        return false;
     }
-
-    // Release spinlock so it can be re-taken as shared in `eval_cpu_timer`.
-    spinlock_release(&tasks_spinlock);
+    timer->timestamp = timestamp;
+    timer->callback  = callback;
+    timer->cookie    = cookie;
+
+    spinlock_take(&wheel->lock);
+    bool idle = true;
+    for (int level = 0; level < TIME_WHEEL_LEVELS; level++) {
+        idle &= !wheel->bitmap[level];
+    }
+    if (idle) {
+        // No timers on this CPU; catch the wheel up without walking the time it spent idle.
+        wheel->tick = time_us() >> TIME_WHEEL_TICK_SHIFT;
+    }
+    wheel_insert(wheel, timer);
+    atomic_store(&timer->wheel, wheel);
+    spinlock_release(&wheel->lock);
 
     // Recalculate this CPU's timer.
-    time_cpulocal_t *ctx = &isr_ctx_get()->cpulocal->time;
     eval_cpu_timer(ctx);
 
     // Re-enable interrupts because we're done with the spinlocks.
     irq_enable_if(ie);
-    return taskno;
-
-error:
-    // Failed to insert into array.
-    spinlock_release(&tasks_spinlock);
-    irq_enable_if(ie);
-    free(task);
-    return -1;
+    return true;
 }
 
-// Cancel a task created with `time_add_async_task`.
-bool time_cancel_async_task(int64_t taskno) {
+// Disarm a timer, which may be armed on any CPU.
+// If the callback is running on another CPU, waits for it to finish; the callback can't be running after this.
+// Returns true if the timer was removed before its callback started running.
+bool time_cancel_timer(timer_node_t *timer) {
     // Interrupts must be disabled while holding spinlock.
     bool ie = irq_disable();
 
-    // Take spinlock while removing from the list.
-    spinlock_take(&tasks_spinlock);
-
-    bool found = false;
-    for (size_t i = 0; i < tasks_len; i++) {
-        if (tasks[i]->taskno == taskno) {
-            found = true;
-            timertask_t *task;
-            array_lencap_remove(&tasks, sizeof(void *), &tasks_len, &tasks_cap, &task, i);
-            // NOLINTNEXTLINE
-            free(task);
+    while (1) {
+        time_wheel_t *wheel = atomic_load(&timer->wheel);
+        if (!wheel) {
+            // Not armed or already firing; in the latter case, let the callback finish.
+            timer_wait_callback(timer);
+            irq_enable_if(ie);
+            return false;
+        }
+        spinlock_take(&wheel->lock);
+        if (atomic_load(&timer->wheel) == wheel) {
+            wheel_remove(wheel, timer);
+            atomic_store(&timer->wheel, NULL);
+            spinlock_release(&wheel->lock);
             break;
         }
+        // The timer fired and was re-armed on another CPU in the meantime.
+        spinlock_release(&wheel->lock);
     }
 
-    // Release spinlock so it can be re-taken as shared in `eval_cpu_timer`.
-    spinlock_release(&tasks_spinlock);
-
-    // Recalculate this CPU's timer.
-    time_cpulocal_t *ctx = &isr_ctx_get()->cpulocal->time;
-    eval_cpu_timer(ctx);
-
-    // Re-enable interrupts because we're done with the spinlocks.
+    // The CPU timer may now fire early, which is harmless.
     irq_enable_if(ie);
-    return found;
+    return true;
 }
 
 // Generic timer init after timer-specific init.
@@ -172,21 +287,22 @@ void time_cpu_timer_isr() {
         sched_request_switch_from_isr();
 
     } else {
-        timertask_t *task;
-
-        // Check if there is a task that needs to run right now.
-        spinlock_take(&tasks_spinlock);
-        if (tasks_len && now >= tasks[tasks_len - 1]->timestamp) {
-            task = tasks[--tasks_len];
-        } else {
-            task = NULL;
-        }
-        spinlock_release(&tasks_spinlock);
-
-        // Run the task, if any.
-        if (task) {
-            task->callback(task->cookie);
-            free(task);
+        // Run all timers that are due, one at a time so they may be re-armed or cancelled by the callbacks.
+        while (1) {
+            spinlock_take(&ctx->wheel.lock);
+            timer_node_t *timer = wheel_pop_expired(&ctx->wheel, now);
+            if (!timer) {
+                spinlock_release(&ctx->wheel.lock);
+                break;
+            }
+            timer_fn_t callback = timer->callback;
+            void      *cookie   = timer->cookie;
+            // Marked running before it is marked disarmed, so `time_cancel_timer` can't miss the callback.
+            atomic_store(&timer->running, smp_cur_cpu() + 1);
+            atomic_store(&timer->wheel, NULL);
+            spinlock_release(&ctx->wheel.lock);
+            callback(cookie);
+            atomic_store(&timer->running, 0);
         }
     }
 
@@ -205,17 +205,21 @@ class OptStr(Option[str]):
 
 
 option_desc = {x.id: x for x in [
-    Desc("compiler",   "compiler",         "C compiler to use for building BadgerOS and apps."),
-    Desc("cpu",        "CPU architecture", "CPU architecture to build for."),
-    Desc("float_spec", "floating-point",   "Largest floating-point type to support."),
-    Desc("vec_spec",   "vector",           "Largest vector type to support."),
-    Desc("stack_size", "stack size",       "Stack size to use for kernel threads."),
+    Desc("compiler",     "compiler",         "C compiler to use for building BadgerOS and apps."),
+    Desc("cpu",          "CPU architecture", "CPU architecture to build for."),
+    Desc("float_spec",   "floating-point",   "Largest floating-point type to support."),
+    Desc("vec_spec",     "vector",           "Largest vector type to support."),
+    Desc("stack_size",   "stack size",       "Stack size to use for kernel threads."),
+    Desc("lock_profile", "lock profiler",    "Record contention statistics for kernel locks (0 or 1)."),
+    Desc("sched_trace",  "scheduler trace",  "Record scheduler events in per-CPU trace buffers (0 or 1)."),
 ]}
 
 default_options = {
-    "stack_size": OptInt(8192, 65536, 4096, 8192),
-    "float_spec": OptConst("none"),
-    "vec_spec":   OptConst("none"),
+    "stack_size":   OptInt(8192, 65536, 4096, 8192),
+    "float_spec":   OptConst("none"),
+    "vec_spec":     OptConst("none"),
+    "lock_profile": OptInt(0, 1, 1, 0),
+    "sched_trace":  OptInt(0, 1, 1, 0),
 }
 
 default_target = "esp32p4"
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+
+# SPDX-License-Identifier: MIT
+
+import sys, json
+from argparse import *
+
+assert __name__ == "__main__"
+
+parser = ArgumentParser(description="Converts scheduler trace records from a kernel log into Chrome/Perfetto trace JSON")
+parser.add_argument("input", action="store", nargs="?", help="Log file to read, defaults to stdin")
+parser.add_argument("-o", "--output", action="store", help="JSON file to write, defaults to stdout")
+args = parser.parse_args()
+
+# Event kinds; must match `common/include/schedtrace.h`.
+SCHEDTRACE_SWITCH  = 1
+SCHEDTRACE_HANDOFF = 2
+SCHEDTRACE_BLOCK   = 3
+SCHEDTRACE_WAKE    = 4
+SCHEDTRACE_MIGRATE = 5
+
+
+
+def signed(value: int, bits: int) -> int:
+    if value >= 1 << (bits - 1):
+        value -= 1 << bits
+    return value
+
+
+def read_records(fd) -> list[tuple[int, int, int, int, int]]:
+    records = []
+    for line in fd:
+        idx = line.find("SCHEDTRACE ")
+        if idx < 0: continue
+        fields = line[idx:].split()
+        if len(fields) != 6: continue
+        try:
+            cpu, time, tid, event, arg = (int(x, 16) for x in fields[1:])
+        except ValueError:
+            continue
+        records.append((time, cpu, signed(tid, 32), event, signed(arg, 16)))
+    records.sort()
+    return records
+
+
+def convert(records) -> list[dict]:
+    events  = []
+    running = {}
+    cpus    = sorted({rec[1] for rec in records})
+    for cpu in cpus:
+        events.append({"ph": "M", "name": "thread_name", "pid": 0, "tid": cpu, "args": {"name": f"CPU {cpu}"}})
+
+    for time, cpu, tid, event, arg in records:
+        if event == SCHEDTRACE_SWITCH:
+            # Close the slice of the thread that was running on this CPU.
+            if cpu in running:
+                start, prev, prio = running[cpu]
+                events.append({
+                    "ph": "X", "name": f"thread {prev}", "pid": 0, "tid": cpu,
+                    "ts": start, "dur": time - start, "args": {"tid": prev, "priority": prio},
+                })
+            running[cpu] = (time, tid, arg)
+        elif event == SCHEDTRACE_HANDOFF:
+            events.append({
+                "ph": "i", "s": "t", "name": f"handoff {tid} to CPU {arg}", "pid": 0, "tid": cpu,
+                "ts": time, "args": {"tid": tid, "cpu": arg},
+            })
+        elif event == SCHEDTRACE_BLOCK:
+            events.append({
+                "ph": "i", "s": "t", "name": f"block {tid}", "pid": 0, "tid": cpu,
+                "ts": time, "args": {"tid": tid, "shared": bool(arg)},
+            })
+        elif event == SCHEDTRACE_WAKE:
+            events.append({
+                "ph": "i", "s": "t", "name": f"wake {tid}", "pid": 0, "tid": cpu,
+                "ts": time, "args": {"tid": tid, "shared": bool(arg)},
+            })
+        elif event == SCHEDTRACE_MIGRATE:
+            events.append({
+                "ph": "i", "s": "t", "name": f"migrate {tid} from CPU {arg}", "pid": 0, "tid": cpu,
+                "ts": time, "args": {"tid": tid, "from": arg},
+            })
+
+    # Close the slices still running at the end of the trace.
+    end = records[-1][0] if records else 0
+    for cpu, (start, prev, prio) in running.items():
+        events.append({
+            "ph": "X", "name": f"thread {prev}", "pid": 0, "tid": cpu,
+            "ts": start, "dur": end - start, "args": {"tid": prev, "priority": prio},
+        })
+    return events
+
+
+
+infd  = open(args.input, "r", errors="replace") if args.input else sys.stdin
+trace = {"traceEvents": convert(read_records(infd)), "displayTimeUnit": "ms"}
+outfd = open(args.output, "w") if args.output else sys.stdout
+json.dump(trace, outfd)
+outfd.write("\n")